@@ -8,285 +8,382 @@
 *  Copyright (c) 2024, Somrath Kanoksirirath.
 *  All rights reserved under BSD 3-clause license.
 *
-*  g++ -Wall -Wextra ./co_curl.cpp -o co-curl -fopenmp -lcurl
+*  g++ -Wall -Wextra ./co_curl.cpp ./cocurl.cpp -o co-curl -fopenmp -lcurl
 *
 ******************************************************************/
 
-// Note:
-// 1) Download to file = this implementation   --> CURLOPT_WRITEFUNCTION, CURLOPT_WRITEDATA
-// 2) Alternatively, to buffer/RAM             --> curl_easy_recv(curl, buf, sizeof(buf), &nread);
-//    Pros: Fast merge
-//    Cons: Possible Out-of-memory error when file parts are too large
-
-#include <filesystem>
-namespace fs = std::filesystem ;
+// Command line interface of libco-curl (cocurl.hpp), the download engine lives in cocurl.cpp
 
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
-#include <curl/curl.h>
-#include <omp.h>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
 
-constexpr int DEFAULT_NUM_THREADS = 8 ;
-constexpr int MIN_FILE_SIZE_FOR_PARALLEL = 1E3 ;
-constexpr int NUM_TRY_DOWNLOAD = 5 ;
+#include "cocurl.hpp"
 
-struct Account {
-    std::string username ;
-    std::string password ;
-};
+using cocurl::DEFAULT_NUM_THREADS ;
+using cocurl::MAX_NUM_CONNECTIONS ;
+using cocurl::MIN_UNIT_SIZE ;
+using cocurl::DEFAULT_STREAM_BUFFER_MB ;
+using cocurl::AUTO_MAX_CONNECTIONS ;
+
+constexpr int PROGRESS_JSON_INTERVAL_MS = 1000 ;
+constexpr int METRICS_INTERVAL_MS = 5000 ;
+
+cocurl::CancellationToken cancellation ;
+
+void handle_interrupt(int){ cancellation.cancel(); }
 
 
 void print_usage(const std::string &executable_name){
     std::cout
     << "Usage: " << executable_name << " [OPTIONS...] <url> \n"
-    << "Download a single file from <url> concurrently \n"
-    << "by splitting it into parts then merge.\n"
+    << "       " << executable_name << " [OPTIONS...] -i <manifest> \n"
+    << "Download a single file from <url> (or every file listed in <manifest>)\n"
+    << "concurrently by splitting it into parts then merge.\n"
     << "\n"
     << "OPTIONS:\n"
-    << "  -nth, --num-thread <num>   specify the number of threads to be used\n"
+    << "  -nth, --num-thread <num>   set the number of merge threads (also the default of -nc)\n"
+    << "  -nc, --num-connection <num> set the number of concurrent connections (default: -nth)\n"
+    << "  -nh, --num-host-connection <num> limit concurrent connections per host (default: -nc)\n"
     << "  -np, --num-part <num>      set the number of parts of the file\n"
     << "  -cs, --chunk-size <MB>     set downloaded chunk size\n"
+    << "  -us, --unit-size <MB>      set the size of work units scheduled to connections\n"
     << "  -s, --single-part <index>  download the specified part then exit\n"
     << "  -m, --merge                merge parts then exit\n"
-    << "  -o, --output <filename>    output filename\n"
+    << "  -r, --ranges <a-b,c-,-n>   fetch only these byte ranges of <url>, concatenated into the output\n"
+    << "  -rg, --range-gap <MB>      with --ranges, also fetch gaps up to <MB> between ranges to save requests\n"
+    << "                             (default: 1)\n"
+    << "  -sr, --single-range        with --ranges, one range per request (no multi-range requests)\n"
+    << "  -d, --direct               write directly into the preallocated output (no part files)\n"
+    << "  -a, --auto                 tune the number of connections on measured throughput, up to -nc\n"
+    << "                             (default: " << AUTO_MAX_CONNECTIONS << ")\n"
+    << "  -o, --output <filename>    output filename, - streams the file in order to stdout\n"
+    << "  -mb, --max-buffer <MB>     memory for reordering ranges when streaming (default: " << DEFAULT_STREAM_BUFFER_MB << ")\n"
+    << "  -lr, --limit-rate <rate>[@hh:mm-hh:mm][,...] cap the bytes/s of all connections together,\n"
+    << "                             K, M or G suffix, e.g. 200M@08:00-18:00,1G (0 --> unlimited)\n"
+    << "  -lb, --limit-burst <MB>    bytes let through at once above the rate (default: 1/4 s of it)\n"
+    << "  -ck, --checksum <algo>[:<hex>] verify (or print) the crc32c, sha256 or md5 of the file\n"
+    << "  -mr, --mirror <url>        another url of the same file, ranges are spread over all (repeatable)\n"
+    << "  -i, --input-file <manifest> download every \"<url> [output [algo:hex]]\" line of <manifest>\n"
+    << "                             or every <file> of a Metalink file, its <url>s used as mirrors\n"
+    << "  -pg, --progress            one live line: MB received, current and average MB/s, ETA,\n"
+    << "                             connections and stragglers\n"
+    << "  -pj, --progress-json <file> the same every second as JSON lines, with every connection\n"
+    << "                             (- for stderr)\n"
+    << "  -tm, --timings <file>      dns, connect, tls, wait and transfer time of every ranged GET,\n"
+    << "                             with bytes, retries and throughput per part (.csv or JSON)\n"
+    << "  -tt, --trace <file>        the same as Chrome trace events, one track per connection\n"
+    << "                             (chrome://tracing or ui.perfetto.dev)\n"
+    << "  -mx, --metrics <file>      keep an OpenMetrics textfile up to date every 5 s: bytes, connections,\n"
+    << "                             requests per HTTP status, retries, verify and merge time\n"
+    << "                             (e.g. for the node_exporter textfile collector, <dir>/co-curl.prom)\n"
     << "  -u, --username <username>  pass username for identification\n"
     << "  -p, --password <password>  pass password for identification\n"
     << "  -v, --verbose              verbose messages\n"
     << "  -h, --help                 print this usage\n"
     << "\n"
     << "  NOTE: --num-part and --chunk-size are mutually execlusive, the lastest takes effect.\n"
-    << "  NOTE: --single-part and --merge are mutually execlusive, the lastest takes effect.\n"
+    << "  NOTE: --single-part, --merge and --ranges are mutually execlusive, the lastest takes effect.\n"
+    << "  NOTE: All connections are driven by a single event loop (curl_multi), not one thread each.\n"
+    << "  NOTE: Idle connections split the remaining range of the slowest one (work stealing).\n"
+    << "  NOTE: --direct only applies when downloading all parts (no --single-part, --merge).\n"
+    << "  NOTE: With --input-file, all files share one connection budget, smallest files first.\n"
+    << "  NOTE: Progress is journaled in <output>.journal, rerun the same command to resume.\n"
+    << "  NOTE: With -o -, ranges beyond --max-buffer ahead of the written output wait (no resume).\n"
+    << "  NOTE: --auto starts from what it learned per host, kept in ~/.cache/co-curl/hosts.\n"
+    << "  NOTE: --limit-rate windows are in local time, the first one containing it applies.\n"
+    << "  NOTE: --progress, --progress-json, --timings, --trace and --metrics only report whole downloads\n"
+    << "        (no --single-part, --merge or --ranges).\n"
+    << "  NOTE: Stragglers run below a quarter of the median connection rate, idle connections split them.\n"
+    << "  NOTE: --ranges fetches whole blocks of --unit-size (default: 1 MB), adjacent blocks in one request,\n"
+    << "        several runs per request (Range: bytes=a-b,c-d) unless the server ignores it.\n"
+    << "  NOTE: Without --checksum, Digest, Repr-Digest, x-goog-hash or Content-MD5 headers are verified\n"
+    << "        (an MD5-looking ETag only warns on mismatch).\n"
     << std::endl;
 }
 
 
-std::string getHttpStatusMessage(long response_code)
+// -pg,--progress: one line on stderr, rewritten in place
+void print_progress(const cocurl::Progress &p)
 {
-    switch (response_code) {
-        case 100: return "100 Continue.";
-        case 101: return "101 Switching Protocols.";
-        case 200: return "200 OK.";
-        case 201: return "201 Created.";
-        case 202: return "202 Accepted.";
-        case 204: return "204 No Content.";
-        case 301: return "301 Moved Permanently.";
-        case 302: return "302 Found.";
-        case 304: return "304 Not Modified.";
-        case 400: return "400 Bad Request.";
-        case 401: return "401 Unauthorized.";
-        case 403: return "403 Forbidden.";
-        case 404: return "404 Not Found.";
-        case 405: return "405 Method Not Allowed.";
-        case 408: return "408 Request Timeout.";
-        case 409: return "409 Conflict.";
-        case 500: return "500 Internal Server Error.";
-        case 501: return "501 Not Implemented.";
-        case 502: return "502 Bad Gateway.";
-        case 503: return "503 Service Unavailable.";
-        case 504: return "504 Gateway Timeout.";
-        case 505: return "505 HTTP Version Not Supported.";
-        default:  return std::to_string(response_code) + " Unknown Response Code.";
-    }
+    char eta[32] = "--:--" ;
+    if( p.eta_s >= 0 ){ std::snprintf(eta, sizeof(eta), "%d:%02d", static_cast<int>(p.eta_s/60), static_cast<int>(p.eta_s) % 60); }
+    std::fprintf(stderr, "\rCO-CURL:: %.1f / %.1f MB  %.1f MB/s (avg %.1f)  ETA %s  %zu connections, %d stragglers  %zu/%zu files\033[K",
+                 p.received/1E6, p.total/1E6, p.rate/1E6, p.average_rate/1E6, eta, p.connections.size(), p.num_stragglers, p.num_finished, p.num_files);
+    if( p.num_finished == p.num_files ){ std::fprintf(stderr, "\n"); }
 }
 
 
-long long int get_file_size(const Account &user, const std::string &url, bool verbose)
+std::string json_string(const std::string &text)
 {
-    CURL *curl ;
-    curl_off_t file_size = 0 ;
-    long response_code ;
-
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
-    if( curl ){
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
-        if( !user.username.empty() ){
-            curl_easy_setopt(curl, CURLOPT_USERNAME, user.username.c_str());
-        }
-        if( !user.password.empty() ){
-            curl_easy_setopt(curl, CURLOPT_PASSWORD, user.password.c_str());
-        }
-
-        if( curl_easy_perform(curl) == CURLE_OK ){
-            if( curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &file_size) != CURLE_OK ){
-                file_size = -1 ;
-                std::cerr << "CO-CURL::ERROR -- Cannot acquire remote file size." << std::endl;
-            }
-            if( file_size == 0 ){
-                file_size = -1 ;
-                std::cerr << "CO-CURL::ERROR -- Remote file is empty (0 bytes)." << std::endl;
-            }
-            if( curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code) == CURLE_OK ){
-                if( response_code >= 400 ){
-                    file_size = -1 ;
-                    std::cerr << "CO-CURL::ERROR -- " << getHttpStatusMessage(response_code) << std::endl;
-                }else if( verbose ){
-                    std::cout << "CO-CURL:: Get file size -- " << getHttpStatusMessage(response_code) << std::endl;
-                }
-            }
-        }else{
-            file_size = -1 ;
-            std::cerr << "CO-CURL::ERROR -- Cannot acquire remote file information." << std::endl;
-        }
-        curl_easy_cleanup(curl);
-    }else{
-        file_size = -1 ;
-        std::cerr << "CO-CURL::ERROR -- Cannot initialize cURL." << std::endl;
+    std::string quoted = "\"" ;
+    for(char c : text){
+        if( c == '"' || c == '\\' ){ quoted += '\\' ; }
+        if( static_cast<unsigned char>(c) < 0x20 ){ continue; }
+        quoted += c ;
     }
-    curl_global_cleanup();
+return quoted + "\""; }
 
-return static_cast<long long int>(file_size); }
 
-
-size_t curl_write_data(void *ptr, size_t size, size_t nmemb, FILE *stream){
-    size_t written = fwrite(ptr, size, nmemb, stream);
-    return written;
+// -pj,--progress-json: one object per line, for job monitors
+void write_progress_json(FILE *out, const cocurl::Progress &p)
+{
+    std::fprintf(out, "{\"elapsed_s\":%.3f,\"received\":%lld,\"total\":%lld,\"rate\":%.0f,\"average_rate\":%.0f,\"eta_s\":%.1f,\"files_finished\":%zu,\"files\":%zu,\"stragglers\":%d,\"connections\":[",
+                 p.elapsed_s, p.received, p.total, p.rate, p.average_rate, p.eta_s, p.num_finished, p.num_files, p.num_stragglers);
+    for(std::size_t i=0 ; i<p.connections.size() ; ++i){
+        const cocurl::ConnectionProgress &c = p.connections[i] ;
+        std::fprintf(out, "%s{\"file\":%zu,\"host\":%s,\"start\":%lld,\"end\":%lld,\"received\":%lld,\"rate\":%.0f,\"straggler\":%s}",
+                     (i) ? "," : "", c.file, json_string(c.host).c_str(), c.start, c.end, c.received, c.rate, (c.straggler) ? "true" : "false");
+    }
+    std::fprintf(out, "]}\n");
+    std::fflush(out);
 }
 
 
-void download(const Account &user, const std::string &output_filename, const std::string &url, const long long int start, const long long int end, bool verbose)
+// -tm,--timings: one row per ranged GET, a .csv file as CSV, otherwise JSON with a summary per part
+bool write_timings(const std::string &filename, const std::vector<cocurl::TransferTiming> &timings)
 {
-    CURL *curl ;
-    CURLcode res ;
-    long response_code ;
-    std::string range = std::to_string(start) + "-" + std::to_string(end) ;
-
-    curl = curl_easy_init();
-    if( curl ){
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_data);
-        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, !verbose);
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, verbose);
-        if( !user.username.empty() ){
-            curl_easy_setopt(curl, CURLOPT_USERNAME, user.username.c_str());
-        }
-        if( !user.password.empty() ){
-            curl_easy_setopt(curl, CURLOPT_PASSWORD, user.password.c_str());
+    FILE *out = std::fopen(filename.c_str(), "w") ;
+    if( !out ){
+        std::cerr << "CO-CURL::ERROR -- Cannot create '" << filename << "' --> " << std::strerror(errno) << std::endl;
+        return false ;
+    }
+    const bool csv = ( filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".csv") == 0 ) ;
+    if( csv ){ std::fprintf(out, "file,part,host,start,end,received,attempt,status,ok,begin_s,dns_s,connect_s,tls_s,wait_s,transfer_s,total_s,throughput_mb_s,error\n"); }
+    else{ std::fprintf(out, "{\"transfers\":[\n"); }
+
+    for(std::size_t i=0 ; i<timings.size() ; ++i){
+        const cocurl::TransferTiming &t = timings[i] ;
+        const double throughput = (t.total_s > 0.0) ? t.received/t.total_s/1E6 : 0.0 ;
+        if( csv ){
+            std::fprintf(out, "%zu,%d,%s,%lld,%lld,%lld,%d,%ld,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%s\n",
+                         t.file, t.part, json_string(t.host).c_str(), t.start, t.end, t.received, t.attempt, t.response_code, t.ok,
+                         t.begin_s, t.dns_s, t.connect_s, t.tls_s, t.wait_s, t.transfer_s, t.total_s, throughput, json_string(t.error).c_str());
+        }else{
+            std::fprintf(out, "%s{\"file\":%zu,\"part\":%d,\"host\":%s,\"start\":%lld,\"end\":%lld,\"received\":%lld,\"attempt\":%d,\"status\":%ld,\"ok\":%s,"
+                              "\"begin_s\":%.6f,\"dns_s\":%.6f,\"connect_s\":%.6f,\"tls_s\":%.6f,\"wait_s\":%.6f,\"transfer_s\":%.6f,\"total_s\":%.6f,\"throughput_mb_s\":%.3f,\"error\":%s}",
+                         (i) ? ",\n" : "", t.file, t.part, json_string(t.host).c_str(), t.start, t.end, t.received, t.attempt, t.response_code, (t.ok) ? "true" : "false",
+                         t.begin_s, t.dns_s, t.connect_s, t.tls_s, t.wait_s, t.transfer_s, t.total_s, throughput, json_string(t.error).c_str());
         }
+    }
 
-        for(int i=0 ; i<NUM_TRY_DOWNLOAD ; ++i)
-        {
-            FILE *fp = fopen(output_filename.c_str(), "wb");
-            if( fp==NULL ){
-                std::printf("CO-CURL::ERROR -- Cannot create '%s' (%d)\n", output_filename.c_str(), i);
-                continue;
-            }
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-            res = curl_easy_perform(curl); // *** Main cURL: download ***
-            fclose(fp);
-
-            if( res == CURLE_OK ){
-                if( curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code) == CURLE_OK ){
-                    if( response_code >= 400 ){
-                        std::printf("CO-CURL::ERROR -- Cannot download '%s' (%d)\n --> %s\n", output_filename.c_str(), i, curl_easy_strerror(res));
-                        std::printf("CO-CURL::ERROR -- %s.\n", getHttpStatusMessage(response_code).c_str());
-                        std::remove(output_filename.c_str());
-                    }
-		    if( verbose ){
-                        std::printf("CO-CURL:: Download -- %s.\n", getHttpStatusMessage(response_code).c_str());
-		    }
-                }
-                break;
-            }else{
-                std::printf("CO-CURL::ERROR -- Cannot download '%s' (%d)\n --> %s\n", output_filename.c_str(), i, curl_easy_strerror(res));
-                std::remove(output_filename.c_str());
-            }
+    if( !csv ){
+        // Per part: bytes kept, ranged GETs, failed ones (each retried or given up), wall time
+        struct Part { long long int bytes = 0 ; int transfers = 0 ; int retries = 0 ; double begin = -1.0 ; double end = 0.0 ; } ;
+        std::map<std::pair<std::size_t, int>, Part> parts ;
+        for(const cocurl::TransferTiming &t : timings){
+            Part &part = parts[std::make_pair(t.file, t.part)] ;
+            part.bytes += t.received ;
+            part.transfers += 1 ;
+            part.retries += !t.ok ;
+            part.begin = (part.begin < 0.0) ? t.begin_s : std::min(part.begin, t.begin_s) ;
+            part.end = std::max(part.end, t.begin_s + t.total_s) ;
         }
-
-        curl_easy_cleanup(curl);
-
-    }else{
-        std::printf("CO-CURL::ERROR -- Cannot initialize cURL for downloading '%s'\n", output_filename.c_str());
+        std::fprintf(out, "\n],\"parts\":[\n");
+        bool first = true ;
+        for(const auto &p : parts){
+            const Part &part = p.second ;
+            const double seconds = part.end - part.begin ;
+            std::fprintf(out, "%s{\"file\":%zu,\"part\":%d,\"bytes\":%lld,\"transfers\":%d,\"retries\":%d,\"seconds\":%.6f,\"throughput_mb_s\":%.3f}",
+                         (first) ? "" : ",\n", p.first.first, p.first.second, part.bytes, part.transfers, part.retries, seconds, (seconds > 0.0) ? part.bytes/seconds/1E6 : 0.0);
+            first = false ;
+        }
+        std::fprintf(out, "\n]}\n");
     }
 
-return; }
+return std::fclose(out) == 0 ; }
 
 
-int check_files(const std::string &filename, const int num_part, const std::uintmax_t chunk_size, const std::uintmax_t last_part_size)
+// -tt,--trace: Chrome trace events (chrome://tracing, ui.perfetto.dev), one track per connection slot,
+// every ranged GET split into its dns, connect, tls, wait and transfer phases
+bool write_trace(const std::string &filename, const std::vector<cocurl::TransferTiming> &timings)
 {
-    int all_present = 1 ;
+    FILE *out = std::fopen(filename.c_str(), "w") ;
+    if( !out ){
+        std::cerr << "CO-CURL::ERROR -- Cannot create '" << filename << "' --> " << std::strerror(errno) << std::endl;
+        return false ;
+    }
 
-    for(int i=0 ; i<num_part ; ++i)
-    {
-        fs::path part_filepath = filename + ".part" + std::to_string(i) ;
-        if( fs::is_empty(part_filepath) ){
-            std::cerr << "CO-CURL::ERROR -- '" << part_filepath.c_str() << "' is not found." << std::endl;
-            all_present = 0 ;
+    // Reported as they end, laid out on the first free slot in order of start
+    std::vector<std::size_t> order(timings.size()) ;
+    for(std::size_t i=0 ; i<order.size() ; ++i){ order[i] = i ; }
+    std::sort(order.begin(), order.end(), [&timings](std::size_t a, std::size_t b){ return timings[a].begin_s < timings[b].begin_s ; });
+    std::vector<double> slot_end ;
+
+    std::fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"co-curl\"}}");
+    for(std::size_t i : order){
+        const cocurl::TransferTiming &t = timings[i] ;
+        std::size_t slot = 0 ;
+        while( slot < slot_end.size() && slot_end[slot] > t.begin_s ){ ++slot; }
+        if( slot == slot_end.size() ){
+            slot_end.push_back(0.0);
+            std::fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"connection %zu\"}}", slot + 1, slot + 1);
         }
-        if( i != num_part-1 ){
-            if( fs::file_size(part_filepath) + 1E6 < chunk_size ){
-                std::cerr << "CO-CURL::WARNING -- '" << part_filepath.c_str() << "' is >1MB smaller than expected. All parts will not be removed as a precaution" << std::endl;
-                all_present = -1 ;
-            }
-        }else{
-            if( fs::file_size(part_filepath) + 1E6 < last_part_size ){
-                std::cerr << "CO-CURL::WARNING -- '" << part_filepath.c_str() << "' is >1MB smaller than expected. All parts will not be removed as a precaution." << std::endl;
-                all_present = -1 ;
-           }
+        slot_end[slot] = t.begin_s + t.total_s ;
+
+        const long long int begin_us = static_cast<long long int>(t.begin_s*1E6) ;
+        std::fprintf(out, ",\n{\"name\":\"bytes %lld-%lld\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%lld,\"dur\":%lld,"
+                          "\"args\":{\"file\":%zu,\"part\":%d,\"host\":%s,\"received\":%lld,\"attempt\":%d,\"status\":%ld,\"error\":%s}}",
+                     t.start, t.end, (t.ok) ? "transfer" : "failed", slot + 1, begin_us, static_cast<long long int>(t.total_s*1E6),
+                     t.file, t.part, json_string(t.host).c_str(), t.received, t.attempt, t.response_code, json_string(t.error).c_str());
+        const std::pair<const char*, double> phases[] = { {"dns", t.dns_s}, {"connect", t.connect_s}, {"tls", t.tls_s}, {"wait", t.wait_s}, {"transfer", t.transfer_s} } ;
+        double offset = 0.0 ;
+        for(const auto &phase : phases){
+            if( phase.second <= 0.0 ){ continue; }
+            std::fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%lld,\"dur\":%lld}",
+                         phase.first, slot + 1, begin_us + static_cast<long long int>(offset*1E6), static_cast<long long int>(phase.second*1E6));
+            offset += phase.second ;
         }
     }
+    std::fprintf(out, "\n]}\n");
 
-return all_present; }
+return std::fclose(out) == 0 ; }
 
 
-bool merge_files(const std::string &output_filename, int num_part, bool verbose)
-{
-    bool normal_exit = true ;
+// -mx,--metrics: the state of a download for an OpenMetrics textfile, from the progress and transfer callbacks
+struct Metrics {
+    std::string filename ;
+    cocurl::Progress progress = cocurl::Progress() ;
+    std::map<long, long long int> responses ; // HTTP status of ranged GETs (0 --> no response) --> count
+    long long int retries = 0 ;               // Ranged GETs that failed, then retried or given up
+    int files_completed = -1 ;                // -1 --> still downloading
+    double verify_s = 0.0 ;
+    double merge_s = 0.0 ;
+    std::chrono::steady_clock::time_point last_write ;
+};
+
 
-    if( verbose ){ std::cout << "--> Creating / Opening '" << output_filename << "'." << std::endl; }
-    std::ofstream output_file(output_filename.c_str(), std::ios::binary);
-    if( !output_file.is_open() ) {
-        std::cerr << "CO-CURL::ERROR -- Cannot create '" << output_filename << "'." << std::endl;
+// Written next to the textfile then renamed, a collector never reads half a file
+bool write_metrics(const Metrics &m)
+{
+    const std::string temp_filename = m.filename + ".tmp" ;
+    FILE *out = std::fopen(temp_filename.c_str(), "w") ;
+    if( !out ){
+        std::cerr << "CO-CURL::ERROR -- Cannot create '" << temp_filename << "' --> " << std::strerror(errno) << std::endl;
+        return false ;
+    }
+    const cocurl::Progress &p = m.progress ;
+    std::fprintf(out, "# TYPE cocurl_received_bytes counter\n# UNIT cocurl_received_bytes bytes\n# HELP cocurl_received_bytes Bytes received in this run, all files.\n");
+    std::fprintf(out, "cocurl_received_bytes_total %lld\n", p.received);
+    std::fprintf(out, "# TYPE cocurl_size_bytes gauge\n# UNIT cocurl_size_bytes bytes\n# HELP cocurl_size_bytes Sizes of all files known so far.\n");
+    std::fprintf(out, "cocurl_size_bytes %lld\n", p.total);
+    std::fprintf(out, "# TYPE cocurl_rate_bytes_per_second gauge\n# HELP cocurl_rate_bytes_per_second Download rate since the previous update.\n");
+    std::fprintf(out, "cocurl_rate_bytes_per_second %.0f\n", p.rate);
+    std::fprintf(out, "# TYPE cocurl_active_connections gauge\n# HELP cocurl_active_connections Ranged GETs in flight.\n");
+    std::fprintf(out, "cocurl_active_connections %zu\n", p.connections.size());
+    std::fprintf(out, "# TYPE cocurl_straggler_connections gauge\n# HELP cocurl_straggler_connections Connections far below the median rate.\n");
+    std::fprintf(out, "cocurl_straggler_connections %d\n", p.num_stragglers);
+    std::fprintf(out, "# TYPE cocurl_requests counter\n# HELP cocurl_requests Ranged GETs by HTTP status, 0 without a response.\n");
+    for(const auto &r : m.responses){ std::fprintf(out, "cocurl_requests_total{status=\"%ld\"} %lld\n", r.first, r.second); }
+    std::fprintf(out, "# TYPE cocurl_retries counter\n# HELP cocurl_retries Ranged GETs that failed, then retried or given up.\n");
+    std::fprintf(out, "cocurl_retries_total %lld\n", m.retries);
+    std::fprintf(out, "# TYPE cocurl_files gauge\n# HELP cocurl_files Files of this run by state.\n");
+    std::fprintf(out, "cocurl_files{state=\"total\"} %zu\n", p.num_files);
+    std::fprintf(out, "cocurl_files{state=\"finished\"} %zu\n", p.num_finished);
+    if( m.files_completed >= 0 ){ std::fprintf(out, "cocurl_files{state=\"completed\"} %d\n", m.files_completed); }
+    std::fprintf(out, "# TYPE cocurl_verify_seconds gauge\n# UNIT cocurl_verify_seconds seconds\n# HELP cocurl_verify_seconds Checksum verification after the download, all files.\n");
+    std::fprintf(out, "cocurl_verify_seconds %.6f\n", m.verify_s);
+    std::fprintf(out, "# TYPE cocurl_merge_seconds gauge\n# UNIT cocurl_merge_seconds seconds\n# HELP cocurl_merge_seconds Checking and merging part files, all files.\n");
+    std::fprintf(out, "cocurl_merge_seconds %.6f\n", m.merge_s);
+    std::fprintf(out, "# TYPE cocurl_elapsed_seconds gauge\n# UNIT cocurl_elapsed_seconds seconds\n# HELP cocurl_elapsed_seconds Since the download started.\n");
+    std::fprintf(out, "cocurl_elapsed_seconds %.3f\n", p.elapsed_s);
+    std::fprintf(out, "# TYPE cocurl_last_update_timestamp_seconds gauge\n# UNIT cocurl_last_update_timestamp_seconds seconds\n# HELP cocurl_last_update_timestamp_seconds When this file was written.\n");
+    std::fprintf(out, "cocurl_last_update_timestamp_seconds %lld\n", static_cast<long long int>(std::time(NULL)));
+    std::fprintf(out, "# EOF\n");
+    if( std::fclose(out) != 0 || std::rename(temp_filename.c_str(), m.filename.c_str()) != 0 ){
+        std::cerr << "CO-CURL::ERROR -- Cannot write '" << m.filename << "' --> " << std::strerror(errno) << std::endl;
+        std::remove(temp_filename.c_str());
         return false ;
     }
 
-    for(int i=0 ; i<num_part ; ++i)
-    {
-        std::string part_filename = output_filename + ".part" + std::to_string(i) ;
+return true; }
 
-        if( verbose ){ std::cout << "--> Opening '" << part_filename << "'." << std::endl; }
-        std::ifstream part_file(part_filename.c_str(), std::ios::binary);
 
-        if( !part_file.is_open() ){
-            std::cerr << "CO-CRUL::ERROR -- Cannot open '" << part_filename << "'." << std::endl;
-            normal_exit = false ;
-            break;
-        }else{
-            if( verbose ){ std::cout << "--> Merging '" << part_filename << "'." << std::endl; }
-            output_file << part_file.rdbuf();
-            part_file.close();
+// -r,--ranges: the byte ranges of url one after another into output_filename (or the stream)
+bool fetch_ranges(const std::string &url, const std::string &spec, const std::string &output_filename, const cocurl::Options &options)
+{
+    cocurl::RemoteFile file(url, options, (options.unit_size > 0) ? options.unit_size : cocurl::DEFAULT_BLOCK_SIZE);
+    file.set_cancellation(&cancellation);
+    const long long int file_size = file.size() ;
+    if( file_size <= 0 ){ return false ; }
+
+    std::vector<cocurl::ByteRange> ranges ;
+    if( !cocurl::parse_byte_ranges(spec, file_size, ranges) ){
+        std::cerr << "CO-CURL::ERROR -- Invalid byte ranges '" << spec << "' of a " << file_size << " bytes file." << std::endl;
+        return false ;
+    }
+    std::vector<std::vector<char>> data ;
+    if( !file.read_ranges(ranges, data) ){
+        std::cerr << "CO-CURL::ERROR -- Cannot fetch byte ranges '" << spec << "' of '" << url << "'." << std::endl;
+        return false ;
+    }
+
+    int fd = (options.stream_fd >= 0) ? options.stream_fd : open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) ;
+    if( fd < 0 ){
+        std::cerr << "CO-CURL::ERROR -- Cannot create '" << output_filename << "' --> " << std::strerror(errno) << std::endl;
+        return false ;
+    }
+    bool success = true ;
+    for(const std::vector<char> &bytes : data){
+        for(std::size_t done = 0 ; success && done < bytes.size() ; ){
+            ssize_t written = write(fd, bytes.data() + done, bytes.size() - done);
+            if( written < 0 && errno == EINTR ){ continue; }
+            if( written <= 0 ){
+                std::cerr << "CO-CURL::ERROR -- Cannot write '" << output_filename << "' --> " << std::strerror(errno) << std::endl;
+                success = false ;
+            }else{
+                done += written ;
+            }
         }
     }
-    if( verbose ){ std::cout << "--> Closing '" << output_filename << "'." << std::endl; }
-    output_file.close();
+    if( fd != options.stream_fd && close(fd) != 0 ){ success = false ; }
 
-return normal_exit; }
+    if( options.verbose ){
+        const cocurl::RemoteFile::Stats stats = file.stats() ;
+        std::printf("CO-CURL:: %zu ranges, %lld blocks in %lld runs fetched in %lld requests (%.1f MB).\n", ranges.size(), stats.misses, stats.ranges, stats.requests, stats.bytes/1E6);
+    }
+
+return success; }
 
 
 int main(int argc, char *argv[])
 {
     // -1 --> Default
-    // num_part   = num_thread
+    // num_part   = num_connection (= num_thread)
     // chunk_size = (Unspecified)
-    int num_thread = DEFAULT_NUM_THREADS ;
-    int num_part = -1 ;
-    long long int chunk_size = -1 ;
+    cocurl::Options options ;
+    int &num_thread = options.num_thread ;
+    int &num_connection = options.num_connection ;
+    int &num_host_connection = options.max_host_connection ;
+    int &num_part = options.num_part ;
+    long long int &chunk_size = options.chunk_size ;
+    long long int &unit_size = options.unit_size ;
+    long long int &max_buffer = options.max_buffer ;
+    std::string &checksum = options.checksum ;
+    std::vector<std::string> mirror_urls ;
 
     // mode
-    // -1 = download small file
     //  0 = download all + merge
     //  1 = download single
     //  2 = merge
+    //  3 = byte ranges
     int mode = 0 ;
     int part_index = -1 ;
+    std::string ranges ;
+    bool &direct_write = options.direct_write ;
+    bool &auto_tune = options.auto_tune ;
 
     std::string executable_name = argv[0] ;
     {
@@ -296,11 +393,17 @@ int main(int argc, char *argv[])
         }
     }
 
-    struct Account identity ;
     std::string url ;
     std::string output_filename ;
+    std::string input_filename ;
+
+    bool show_progress = false ;
+    std::string progress_json_filename ;
+    std::string timings_filename ;
+    std::string trace_filename ;
+    Metrics metrics ;
 
-    bool verbose = false ;
+    bool &verbose = options.verbose ;
     bool start = true ;
     bool normal_exit = true ;
     for(int i=1 ; i<argc ; ++i)
@@ -322,6 +425,36 @@ int main(int argc, char *argv[])
                 normal_exit = false ;
                 break;
             }
+        }else if( arg=="-nc" || arg=="--num-connection" ){
+            if( i+1<argc ){
+                num_connection = abs(std::atoi( argv[++i] ));
+                if( num_connection == 0 || num_connection > MAX_NUM_CONNECTIONS ){
+                    num_connection = -1 ;
+                    std::cout
+                    << "CO-CURL::WARNING -- Invalid input for option -nc,--num-connection, it must be in range [1-"
+                    << MAX_NUM_CONNECTIONS << "], will use the default value." << std::endl;
+                }
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -nc,--num-connection requires an integer number." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-nh" || arg=="--num-host-connection" ){
+            if( i+1<argc ){
+                num_host_connection = abs(std::atoi( argv[++i] ));
+                if( num_host_connection == 0 ){
+                    num_host_connection = -1 ;
+                    std::cout
+                    << "CO-CURL::WARNING -- Invalid input for option -nh,--num-host-connection, will use the default value."
+                    << std::endl;
+                }
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -nh,--num-host-connection requires an integer number." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
         }else if( arg=="-np" || arg=="--num-part" ){
             if( i+1<argc ){
                 num_part = abs(std::atoi( argv[++i] ));
@@ -347,9 +480,40 @@ int main(int argc, char *argv[])
                     << "CO-CURL::WARNING -- Invalid input for option -cs,--chunk-size, it must be greater than 10. This input will be discarded."
                     << std::endl;
                 }
+                chunk_size *= 1E6 ;
                 num_part = -1 ;
             }else{
-                std::cerr << "CO-CURL::ERROR -- Option -np,--num-part requires an integer number." << std::endl;
+                std::cerr << "CO-CURL::ERROR -- Option -cs,--chunk-size requires an integer number." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-us" || arg=="--unit-size" ){
+            if( i+1<argc ){
+                unit_size = abs(std::atoll( argv[++i] ))*1E6 ;
+                if( unit_size < MIN_UNIT_SIZE ){
+                    unit_size = -1 ;
+                    std::cout
+                    << "CO-CURL::WARNING -- Invalid input for option -us,--unit-size, it must be at least 1 MB. This input will be discarded."
+                    << std::endl;
+                }
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -us,--unit-size requires an integer number." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-mb" || arg=="--max-buffer" ){
+            if( i+1<argc ){
+                max_buffer = abs(std::atoll( argv[++i] ))*1000000LL ;
+                if( max_buffer < MIN_UNIT_SIZE ){
+                    max_buffer = DEFAULT_STREAM_BUFFER_MB*1000000LL ;
+                    std::cout
+                    << "CO-CURL::WARNING -- Invalid input for option -mb,--max-buffer, it must be at least 1 MB, will use the default value."
+                    << std::endl;
+                }
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -mb,--max-buffer requires an integer number." << std::endl;
                 start = false ;
                 normal_exit = false ;
                 break;
@@ -372,6 +536,57 @@ int main(int argc, char *argv[])
             }
         }else if( arg=="-m" || arg=="--merge" ){
             mode = 2 ;
+        }else if( arg=="-r" || arg=="--ranges" ){
+            mode = 3 ;
+            if( i+1<argc ){
+                ranges = argv[++i] ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -r,--ranges requires a list of byte ranges." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-rg" || arg=="--range-gap" ){
+            if( i+1<argc ){
+                options.range_gap = abs(std::atoll( argv[++i] ))*1000000LL ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -rg,--range-gap requires an integer number." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-lr" || arg=="--limit-rate" ){
+            if( i+1<argc ){
+                if( !cocurl::parse_rate_limit(argv[++i], options.limit_rate, options.limit_schedule) ){
+                    std::cerr << "CO-CURL::ERROR -- Invalid input for option -lr,--limit-rate '" << argv[i] << "'." << std::endl;
+                    start = false ;
+                    normal_exit = false ;
+                    break;
+                }
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -lr,--limit-rate requires a rate." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-lb" || arg=="--limit-burst" ){
+            const double burst = (i+1<argc) ? std::abs(std::atof( argv[i+1] ))*1E6 : NAN ;
+            if( std::isfinite(burst) && burst < 9.2E18 ){
+                options.limit_burst = static_cast<long long int>(burst) ;
+                if( options.limit_burst <= 0 ){ options.limit_burst = -1 ; }
+                ++i ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -lb,--limit-burst requires a number." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-sr" || arg=="--single-range" ){
+            options.multi_range = false ;
+        }else if( arg=="-d" || arg=="--direct" ){
+            direct_write = true ;
+        }else if( arg=="-a" || arg=="--auto" ){
+            auto_tune = true ;
         }else if( arg=="-o" || arg=="--output" ){
             if( i+1<argc ){
                 output_filename = argv[++i] ;
@@ -381,9 +596,36 @@ int main(int argc, char *argv[])
                 normal_exit = false ;
                 break;
             }
+        }else if( arg=="-ck" || arg=="--checksum" ){
+            if( i+1<argc && cocurl::valid_checksum(argv[i+1]) ){
+                checksum = argv[++i] ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -ck,--checksum requires <algorithm>[:<hex>] with algorithm crc32c, sha256 or md5." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-mr" || arg=="--mirror" ){
+            if( i+1<argc ){
+                mirror_urls.push_back(argv[++i]);
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -mr,--mirror requires a url."<< std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-i" || arg=="--input-file" ){
+            if( i+1<argc ){
+                input_filename = argv[++i] ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -i,--input-file requires a filename."<< std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
         }else if( arg=="-u" || arg=="--username" ){
             if( i+1<argc ){
-                identity.username = argv[++i] ;
+                options.username = argv[++i] ;
             }else{
                 std::cerr << "CO-CURL::ERROR -- No username specified for option -u,--username."<< std::endl;
                 start = false ;
@@ -392,13 +634,42 @@ int main(int argc, char *argv[])
             }
         }else if( arg=="-p" || arg=="--password" ){
             if( i+1<argc ){
-                identity.password = argv[++i] ;
+                options.password = argv[++i] ;
             }else{
                 std::cerr << "CO-CURL::ERROR -- No password specified for option -p,--password."<< std::endl;
                 start = false ;
                 normal_exit = false ;
                 break;
             }
+        }else if( arg=="-pg" || arg=="--progress" ){
+            show_progress = true ;
+        }else if( arg=="-pj" || arg=="--progress-json" ){
+            if( i+1<argc ){
+                progress_json_filename = argv[++i] ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -pj,--progress-json requires a filename." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-mx" || arg=="--metrics" ){
+            if( i+1<argc ){
+                metrics.filename = argv[++i] ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option -mx,--metrics requires a filename." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
+        }else if( arg=="-tm" || arg=="--timings" || arg=="-tt" || arg=="--trace" ){
+            if( i+1<argc ){
+                ((arg=="-tm" || arg=="--timings") ? timings_filename : trace_filename) = argv[++i] ;
+            }else{
+                std::cerr << "CO-CURL::ERROR -- Option " << arg << " requires a filename." << std::endl;
+                start = false ;
+                normal_exit = false ;
+                break;
+            }
         }else if( arg=="-v" || arg=="--verbose" ){
             verbose = true ;
         }else if( arg=="-h" || arg=="--help" ){
@@ -423,7 +694,12 @@ int main(int argc, char *argv[])
     if( !start ){ return (normal_exit) ? 0:1 ; }
 
 
-    if( url.empty() ){
+    if( !input_filename.empty() ){
+        if( mode!=0 || !url.empty() ){
+            std::cerr << "CO-CURL::ERROR -- Option -i,--input-file cannot be combined with <url>, -s,--single-part, -m,--merge or -r,--ranges." << std::endl;
+            return 1 ;
+        }
+    }else if( url.empty() ){
         print_usage(executable_name);
         std::cerr << "CO-CURL::ERROR -- No url specified." << std::endl;
         return 1 ;
@@ -433,135 +709,130 @@ int main(int argc, char *argv[])
         }
     }
 
-    long long int file_size = get_file_size(identity, url, verbose);
-    if( file_size <= 0 ){ return 1 ; }
-    if( file_size < MIN_FILE_SIZE_FOR_PARALLEL ){
-        mode = -1 ;
-        chunk_size = -1 ;
-        num_part = 1 ;
+    if( !checksum.empty() && mode!=0 ){
+        std::cerr << "CO-CURL::ERROR -- Option -ck,--checksum cannot be combined with -s,--single-part, -m,--merge or -r,--ranges." << std::endl;
+        return 1 ;
     }
-
-    if( chunk_size < 0 ){
-        if( num_part < 0 ){ num_part = num_thread ; }
-        chunk_size = file_size/num_part ;
-    }else{
-        if( num_part < 0 ){
-            chunk_size *= 1E6 ;
-            num_part = file_size/chunk_size + 1 ;
-        }else{
-            std::cerr << "CO-CURL::ERROR -- Something wrong internally." << std::endl;
-        }
+    if( (show_progress || !progress_json_filename.empty() || !timings_filename.empty() || !trace_filename.empty() || !metrics.filename.empty()) && mode!=0 ){
+        std::cerr << "CO-CURL::ERROR -- Options -pg,--progress, -pj,--progress-json, -tm,--timings, -tt,--trace and -mx,--metrics cannot be combined with -s,--single-part, -m,--merge or -r,--ranges." << std::endl;
+        return 1 ;
     }
-
-    if( mode==0 && num_part < num_thread ){ num_thread = num_part ; }
-
-    if( part_index > num_part-1 ){
-        std::cerr
-        << "CO-CURL::ERROR -- Invalid input for option -s,--single-part, incorrect file index "
-        << part_index << " is not in range [0-" << num_part-1 << "]." << std::endl;
-        return 1;
+    if( !mirror_urls.empty() && mode!=0 ){
+        std::cerr << "CO-CURL::ERROR -- Option -mr,--mirror cannot be combined with -s,--single-part, -m,--merge or -r,--ranges." << std::endl;
+        return 1 ;
     }
-
-
-    if( !normal_exit ){ return 1 ; }
-
-
-    // Info
-    if( verbose ){
-        if( mode==-1 ){
-            std::cout << "\n"
-            << " From URL: " << url << "\n"
-            << " Download: " << output_filename << "\n"
-            << " Having about " << chunk_size/1E6 << " MB.\n"
-            << std::endl;
-        }else if( mode==0 ){
-            std::cout << "\n"
-            << " Download: " << url << "\n"
-            << " Output: " << output_filename << "\n"
-            << " By splitting into " << num_part << " parts, each about " << chunk_size/1E6 << " MB.\n"
-            << " which will be downloaded concurrently using " << num_thread << " threads.\n"
-            << std::endl;
-        }else if( mode==1 ){
-            std::cout << "\n"
-            << " From URL: " << url << "\n"
-            << " Download: " << output_filename << ".part" << part_index << "\n"
-            << " From totally " << num_part << " parts, each about " << chunk_size/1E6 << " MB.\n"
-            << "\n"
-            << " Note: replace -s,--single-part <index> with -m,--merge option to merge them.\n"
-            << std::endl;
-        }else if( mode==2 ){
-            std::cout << "\n"
-            << " Output: " << output_filename << "\n"
-            << " Merging " << num_part << " parts, each about " << chunk_size/1E6 << " MB.\n"
-            << std::endl;
-        }else{
-            std::cerr << "CO-CURL::ERROR -- Something wrong internally." << std::endl;
-        }
+    if( !mirror_urls.empty() && !input_filename.empty() ){
+        std::cerr << "CO-CURL::ERROR -- Give mirrors as <url> elements of a Metalink file with -i,--input-file, not -mr,--mirror." << std::endl;
+        return 1 ;
+    }
+    if( checksum.find(':') != std::string::npos && !input_filename.empty() ){
+        std::cerr << "CO-CURL::ERROR -- Give expected checksums in the manifest, -ck,--checksum only takes an algorithm with -i,--input-file." << std::endl;
+        return 1 ;
     }
 
-
-    // Download
-    if( mode==-1 ){
-        download(identity, output_filename, url, 0, file_size-1, verbose);
-    }else if( mode==0 ){
-        if( verbose ){
-            std::cout
-            << "--> Initializing cURL.\n"
-            << "--> Displaying cRUL information and progress of thread 0." << std::endl;
+    // Streaming: keep the real stdout for data, messages go to stderr
+    int &stream_fd = options.stream_fd ;
+    if( output_filename == "-" ){
+        if( mode==1 || mode==2 ){
+            std::cerr << "CO-CURL::ERROR -- Option -o - cannot be combined with -s,--single-part or -m,--merge." << std::endl;
+            return 1 ;
         }
-        curl_global_init(CURL_GLOBAL_ALL);
-
-        omp_set_num_threads(num_thread);
-        #pragma omp parallel for proc_bind(spread)
-        for(int i=0 ; i<num_part ; ++i){
-            // Inclusive range
-            long long int start = i*chunk_size ;
-            long long int end = (i==num_part-1)  ?  file_size - 1 : start + chunk_size - 1 ;
-            std::string part_filename = output_filename + ".part" + std::to_string(i) ;
-            bool display_progress = verbose && !static_cast<bool>(omp_get_thread_num());
-            download(identity, part_filename, url, start, end, display_progress);
-            if( verbose ){ std::printf("\nThread %2d -- Finish downloading '%s'.", omp_get_thread_num(), part_filename.c_str()); }
+        std::cout.flush();
+        stream_fd = dup(STDOUT_FILENO);
+        if( stream_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 ){
+            std::cerr << "CO-CURL::ERROR -- Cannot set up the output stream --> " << std::strerror(errno) << std::endl;
+            return 1 ;
         }
+        std::signal(SIGPIPE, SIG_IGN);
+    }
 
-        if( verbose ){ std::cout << "\n--> Cleaning up cRUL." << std::endl; }
-        curl_global_cleanup();
-    }else if( mode==1 ){
-        const int i = part_index ;
-        {
-            long long int start = i*chunk_size ;
-            long long int end = (i==num_part-1)  ?  file_size - 1 : start + chunk_size - 1 ;
-            std::string part_filename = output_filename + ".part" + std::to_string(i) ;
-            download(identity, part_filename, url, start, end, verbose);
+    std::vector<cocurl::Request> requests ;
+    if( mode==0 ){
+        if( input_filename.empty() ){
+            cocurl::Request request ;
+            request.url = url ;
+            request.output_filename = output_filename ;
+            request.mirrors = mirror_urls ;
+            requests.push_back(request);
+        }else if( !cocurl::read_manifest(input_filename, requests) ){
+            return 1 ;
+        }
+        for(const cocurl::Request &request : requests){
+            if( request.output_filename == "-" && stream_fd < 0 ){
+                std::cerr << "CO-CURL::ERROR -- Streaming to stdout (-) is not supported in a manifest." << std::endl;
+                return 1 ;
+            }
         }
     }
 
+    cocurl::Downloader downloader(options);
+    downloader.set_cancellation(&cancellation);
 
-    // Check, Merge, Remove
-    if( mode==0 || mode==2 ){
-        if( verbose ){ std::cout << "--> Checking part files." << std::endl; }
-        int part_status = check_files(output_filename, num_part, chunk_size, file_size - (num_part-1)*chunk_size) ;
-
-        if( part_status != 0 ){
-            if( verbose ){ std::cout << "--> Starting merging part files." << std::endl; }
-            normal_exit = merge_files(output_filename, num_part, verbose);
-        }else{
-            std::cerr << "CO-CURL::ERROR -- Some parts are missing." << std::endl;
-            normal_exit = false ;
+    FILE *progress_json = NULL ;
+    if( !progress_json_filename.empty() ){
+        progress_json = (progress_json_filename == "-") ? stderr : std::fopen(progress_json_filename.c_str(), "w") ;
+        if( !progress_json ){
+            std::cerr << "CO-CURL::ERROR -- Cannot create '" << progress_json_filename << "' --> " << std::strerror(errno) << std::endl;
+            return 1 ;
         }
-
-        if( normal_exit ){
-            if( part_status == 1 ){
-                for(int i=0 ; i<num_part ; ++i){
-                    if( verbose ){ std::cout << "--> Deleting '" << output_filename + ".part" + std::to_string(i) << "'."  << std::endl; }
-                    std::remove( (output_filename + ".part" + std::to_string(i)).c_str() );
+    }
+    if( show_progress || progress_json || !metrics.filename.empty() ){
+        std::chrono::steady_clock::time_point last_json ;
+        downloader.on_progress([show_progress, progress_json, last_json, &metrics](const cocurl::Progress &p) mutable {
+            if( show_progress ){ print_progress(p); }
+            const auto now = std::chrono::steady_clock::now() ;
+            if( progress_json && (p.num_finished == p.num_files || now - last_json >= std::chrono::milliseconds(PROGRESS_JSON_INTERVAL_MS)) ){
+                write_progress_json(progress_json, p);
+                last_json = now ;
+            }
+            if( !metrics.filename.empty() ){
+                metrics.progress = p ;
+                // The last one is written with the verify and merge times
+                if( p.num_finished < p.num_files && now - metrics.last_write >= std::chrono::milliseconds(METRICS_INTERVAL_MS) ){
+                    write_metrics(metrics);
+                    metrics.last_write = now ;
                 }
             }
-        }else{
-            if( verbose ){ std::cout << "--> Deleting '" << output_filename << "'." << std::endl; }
-            std::remove( output_filename.c_str() );
+        });
+    }
+    std::vector<cocurl::TransferTiming> timings ;
+    const bool keep_timings = !timings_filename.empty() || !trace_filename.empty() ;
+    if( keep_timings || !metrics.filename.empty() ){
+        downloader.on_transfer([&timings, &metrics, keep_timings](const cocurl::TransferTiming &t){
+            if( keep_timings ){ timings.push_back(t); }
+            metrics.responses[t.response_code] += 1 ;
+            metrics.retries += !t.ok ;
+        });
+    }
+    std::signal(SIGINT, handle_interrupt);
+    std::signal(SIGTERM, handle_interrupt);
+
+    if( mode==0 ){
+        normal_exit = downloader.download(requests);
+        if( requests.size() > 1 ){
+            int num_completed = 0 ;
+            for(const cocurl::Request &request : requests){ num_completed += request.completed ; }
+            std::cout << "CO-CURL:: Downloaded " << num_completed << " of " << requests.size() << " files." << std::endl;
+        }
+        if( !metrics.filename.empty() ){
+            metrics.files_completed = 0 ;
+            for(const cocurl::Request &request : requests){
+                metrics.files_completed += request.completed ;
+                metrics.verify_s += request.verify_s ;
+                metrics.merge_s += request.merge_s ;
+            }
+            if( !write_metrics(metrics) ){ normal_exit = false ; }
         }
+    }else if( mode==1 ){
+        normal_exit = downloader.download_part(url, output_filename, part_index);
+    }else if( mode==2 ){
+        normal_exit = downloader.merge_parts(url, output_filename);
+    }else if( mode==3 ){
+        normal_exit = fetch_ranges(url, ranges, output_filename, options);
     }
+    if( progress_json && progress_json != stderr ){ std::fclose(progress_json); }
+    if( !timings_filename.empty() && !write_timings(timings_filename, timings) ){ normal_exit = false ; }
+    if( !trace_filename.empty() && !write_trace(trace_filename, timings) ){ normal_exit = false ; }
 
 
 return (normal_exit) ? 0:1 ; }
-
@@ -0,0 +1,759 @@
+/******************************************************************
+*
+*  co-curl-bench (Concurrent cURL benchmark)
+*
+*  Time the download and merge paths of libco-curl
+*  against a local HTTP/1.1 range server
+*
+*  Copyright (c) 2024, Somrath Kanoksirirath.
+*  All rights reserved under BSD 3-clause license.
+*
+*  g++ -Wall -Wextra -O2 ./co_curl_bench.cpp ./cocurl.cpp -o co-curl-bench -fopenmp -lcurl -pthread
+*
+******************************************************************/
+
+// The server is forked first, before any thread exists, and serves each connection on a thread.
+// Every run is then a forked child of its own, so wait4() reports its CPU time and peak RSS alone
+// (the server excluded), and no curl or OpenMP state is shared between runs.
+//
+// Faults are chosen per URL (?fault=<name>) and hit every --fault-every-th ranged GET not starting
+// at byte 0 (co-curl's size probe), so retries and the other connections get good responses:
+// the time to completion shows what each one costs.
+//    reset       connection reset (RST) halfway through the body
+//    stall       body stops halfway for --fault-stall seconds, then continues
+//    throttle    body at --fault-bandwidth
+//    503         Service Unavailable
+//    bad-range   206 for another range than asked (Content-Range says which)
+//    no-range    200 with the whole file instead of 206
+
+#include <filesystem>
+namespace fs = std::filesystem ;
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "cocurl.hpp"
+
+using cocurl::DEFAULT_NUM_THREADS ;
+
+constexpr int DEFAULT_FILE_SIZE_MB = 256 ;
+constexpr int SEND_SLICE_SIZE = 1<<16 ;
+constexpr int MAX_REQUEST_HEADER_SIZE = 1<<16 ;
+constexpr int DEFAULT_FAULT_EVERY = 4 ;
+constexpr int DEFAULT_FAULT_STALL_S = 3 ;
+constexpr int DEFAULT_FAULT_BANDWIDTH_MB = 1 ;
+constexpr int DEFAULT_TIMEOUT_S = 300 ;
+constexpr int WAIT_INTERVAL_MS = 5 ;
+constexpr double DEFAULT_TOLERANCE_PERCENT = 25 ;
+const std::string BENCH_FILENAME = "co-curl-bench.bin" ;
+const std::vector<std::string> FAULTS = {"none", "reset", "stall", "throttle", "503", "bad-range", "no-range"} ;
+const std::vector<std::string> COLUMNS = {"mode", "fault", "num_thread", "num_part", "chunk_size_mb", "file_size_mb", "latency_ms", "bandwidth_mb_s",
+                                          "run", "ok", "seconds", "throughput_mb_s", "user_s", "sys_s", "cpu_s", "peak_rss_mb"} ;
+constexpr int NUM_KEY_COLUMNS = 8 ;  // The setting of a row, mode to bandwidth_mb_s
+const std::vector<std::string> MEASURES = {"seconds", "cpu_s", "peak_rss_mb"} ;  // Compared with --baseline
+
+
+struct ServerConfig {
+    long long int file_size ;
+    int latency_ms ;          // Before every response
+    double bandwidth ;        // Bytes/s per connection, 0 --> unlimited
+    int fault_every ;         // Every n-th ranged GET of a ?fault= URL is faulty
+    double fault_stall_s ;
+    double fault_bandwidth ;  // Bytes/s of a throttled response
+};
+
+std::atomic<long long int> num_ranged_get{0} ;  // Of ?fault= URLs, in the server process
+
+
+// Served bytes: a pseudo-random pattern repeating every PATTERN_SIZE bytes (off any power of two,
+// so parts and blocks do not line up with it), sent straight from memory and checked against it
+constexpr int PATTERN_SIZE = (1<<20) + 7 ;
+
+const std::vector<char>& pattern()
+{
+    static const std::vector<char> bytes = []{
+        std::vector<char> b(PATTERN_SIZE) ;
+        unsigned long long int x = 0x9E3779B97F4A7C15ULL ;
+        for(char &c : b){
+            x ^= x << 13 ; x ^= x >> 7 ; x ^= x << 17 ;
+            c = static_cast<char>(x) ;
+        }
+        return b ;
+    }();
+    return bytes ;
+}
+
+
+bool send_all(int fd, const char *data, std::size_t length)
+{
+    while( length > 0 ){
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if( sent < 0 ){
+            if( errno == EINTR ){ continue; }
+            return false ;
+        }
+        data += sent ;
+        length -= sent ;
+    }
+return true; }
+
+
+// "bytes=a-b", "bytes=a-" or "bytes=-n" into an inclusive range of the file, false --> 416
+bool parse_range(const std::string &value, long long int file_size, long long int &first, long long int &last)
+{
+    long long int a, b ;
+    const std::size_t pos = value.find_first_not_of(" \t") ;
+    if( pos == std::string::npos ){ return false ; }
+    const char *spec = value.c_str() + pos ;
+    if( strncasecmp(spec, "bytes=", 6) != 0 || std::strchr(spec, ',') ){ return false ; }
+    spec += 6 ;
+    if( std::sscanf(spec, "-%lld", &b) == 1 ){
+        first = std::max(file_size - b, 0LL) ;
+        last = file_size - 1 ;
+    }else if( std::sscanf(spec, "%lld-%lld", &a, &b) == 2 ){
+        first = a ;
+        last = std::min(b, file_size - 1) ;
+    }else if( std::sscanf(spec, "%lld-", &a) == 1 ){
+        first = a ;
+        last = file_size - 1 ;
+    }else{
+        return false ;
+    }
+return first <= last && first < file_size; }
+
+
+// Requests of one keep-alive connection, until the client closes it
+void serve_connection(int fd, ServerConfig config)
+{
+    std::string buffer ;
+    char chunk[4096] ;
+    const char *content = pattern().data() ;
+    while( true )
+    {
+        std::size_t header_end ;
+        while( (header_end = buffer.find("\r\n\r\n")) == std::string::npos ){
+            if( buffer.size() > MAX_REQUEST_HEADER_SIZE ){ close(fd); return ; }
+            ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+            if( received < 0 && errno == EINTR ){ continue; }
+            if( received <= 0 ){ close(fd); return ; }
+            buffer.append(chunk, received);
+        }
+        std::istringstream lines(buffer.substr(0, header_end));
+        buffer.erase(0, header_end + 4);
+
+        std::string method, target, line, range ;
+        bool keep_alive = true ;
+        lines >> method >> target ;
+        std::getline(lines, line);
+        while( std::getline(lines, line) ){
+            if( strncasecmp(line.c_str(), "range:", 6) == 0 ){ range = line.substr(6) ; }
+            if( strncasecmp(line.c_str(), "connection:", 11) == 0 && line.find("close") != std::string::npos ){ keep_alive = false ; }
+        }
+
+        long long int first = 0, last = config.file_size - 1 ;
+        int status = 200 ;
+        if( method != "GET" && method != "HEAD" ){ status = 405 ; }
+        else if( target.substr(1, target.find('?') - 1) != BENCH_FILENAME ){ status = 404 ; }
+        else if( !range.empty() ){ status = parse_range(range, config.file_size, first, last) ? 206 : 416 ; }
+
+        // Never a range from byte 0, which also tells co-curl the file size
+        const std::size_t query = target.find("?fault=") ;
+        std::string fault = (query == std::string::npos) ? "none" : target.substr(query + 7) ;
+        if( fault != "none" && status == 206 && method == "GET" && first > 0 ){
+            if( num_ranged_get++ % config.fault_every != config.fault_every - 1 ){ fault = "none" ; }
+        }else{
+            fault = "none" ;
+        }
+        double bandwidth = config.bandwidth ;
+        if( fault == "503" ){ status = 503 ; }
+        else if( fault == "no-range" ){ status = 200 ; first = 0 ; last = config.file_size - 1 ; }
+        else if( fault == "bad-range" ){ first = (first > 0) ? first - 1 : std::min(first + 1, last) ; }
+        else if( fault == "throttle" ){ bandwidth = config.fault_bandwidth ; }
+
+        if( config.latency_ms > 0 ){ std::this_thread::sleep_for(std::chrono::milliseconds(config.latency_ms)); }
+
+        std::string header = "HTTP/1.1 " + std::to_string(status) ;
+        header += (status == 200) ? " OK\r\n" : (status == 206) ? " Partial Content\r\n" : (status == 404) ? " Not Found\r\n" : (status == 405) ? " Method Not Allowed\r\n" : (status == 503) ? " Service Unavailable\r\n" : " Range Not Satisfiable\r\n" ;
+        header += "Accept-Ranges: bytes\r\nContent-Type: application/octet-stream\r\n" ;
+        if( status == 206 ){ header += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(config.file_size) + "\r\n" ; }
+        if( status == 416 ){ header += "Content-Range: bytes */" + std::to_string(config.file_size) + "\r\n" ; }
+        const long long int length = (status == 200 || status == 206) ? last - first + 1 : 0 ;
+        header += "Content-Length: " + std::to_string(length) + "\r\n\r\n" ;
+        if( !send_all(fd, header.data(), header.size()) ){ close(fd); return ; }
+
+        // Body in slices, paced to the per connection bandwidth
+        auto begin = std::chrono::steady_clock::now() ;
+        const long long int halfway = first + length/2 ;
+        for(long long int pos = first ; method == "GET" && length > 0 && pos <= last ; ){
+            const long long int at = pos % PATTERN_SIZE ;
+            const std::size_t n = std::min({static_cast<long long int>(SEND_SLICE_SIZE), last - pos + 1, PATTERN_SIZE - at, (pos < halfway) ? halfway - pos : last - pos + 1}) ;
+            if( !send_all(fd, content + at, n) ){ close(fd); return ; }
+            pos += n ;
+            if( pos == halfway && fault == "reset" ){
+                linger reset = {1, 0} ;
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+                close(fd);
+                return ;
+            }
+            if( pos == halfway && fault == "stall" ){
+                std::this_thread::sleep_for(std::chrono::duration<double>(config.fault_stall_s));
+                begin += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.fault_stall_s)) ;
+            }
+            if( bandwidth > 0 ){
+                std::this_thread::sleep_until(begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((pos - first)/bandwidth)));
+            }
+        }
+        if( !keep_alive ){ break; }
+    }
+    close(fd);
+}
+
+
+// Listen on an ephemeral loopback port and serve from a child process, -1 on failure
+pid_t start_server(const ServerConfig &config, int &port)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if( listen_fd < 0 ){ return -1 ; }
+    int yes = 1 ;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address ;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET ;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK) ;
+    address.sin_port = 0 ;
+    socklen_t address_length = sizeof(address) ;
+    if( bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0
+        || getsockname(listen_fd, reinterpret_cast<sockaddr*>(&address), &address_length) != 0 ){
+        close(listen_fd);
+        return -1 ;
+    }
+    port = ntohs(address.sin_port) ;
+
+    pid_t pid = fork();
+    if( pid == 0 ){
+        prctl(PR_SET_PDEATHSIG, SIGTERM);  // Gone with the benchmark, however it ends
+        std::signal(SIGPIPE, SIG_IGN);
+        pattern();
+        while( true ){
+            int fd = accept(listen_fd, NULL, NULL);
+            if( fd < 0 ){
+                if( errno == EINTR || errno == ECONNABORTED ){ continue; }
+                _exit(1);
+            }
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            std::thread(serve_connection, fd, config).detach();
+        }
+    }
+    close(listen_fd);
+
+return pid; }
+
+
+// One point of the matrix, -1 --> co-curl's default
+struct Setting {
+    std::string mode ;          // merge (part files), direct (-d), stream (-o -) or parts (-s each, then -m)
+    std::string fault ;
+    int num_thread ;
+    int num_part ;
+    long long int chunk_size ;
+};
+
+struct Result {
+    bool ok ;
+    double seconds ;
+    double user_s ;
+    double sys_s ;
+    double peak_rss_mb ;
+    bool timed_out ;
+};
+
+
+bool verify_file(const std::string &filename, long long int file_size)
+{
+    std::error_code error ;
+    if( static_cast<long long int>(fs::file_size(filename, error)) != file_size || error ){ return false ; }
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<char> data(PATTERN_SIZE) ;
+    for(long long int pos = 0 ; pos < file_size ; ){
+        const std::size_t n = std::min(static_cast<long long int>(PATTERN_SIZE), file_size - pos) ;
+        if( !file.read(data.data(), n) ){ return false ; }
+        if( std::memcmp(data.data(), pattern().data(), n) != 0 ){ return false ; }
+        pos += n ;
+    }
+return true; }
+
+
+// The output and everything co-curl leaves next to it (parts, journal)
+void remove_outputs(const std::string &output_filename)
+{
+    const fs::path output(output_filename) ;
+    const fs::path directory = output.has_parent_path() ? output.parent_path() : fs::path(".") ;
+    const std::string name = output.filename().string() ;
+    std::error_code error ;
+    for(const fs::directory_entry &entry : fs::directory_iterator(directory, error)){
+        if( entry.path().filename().string().compare(0, name.size(), name) == 0 ){ fs::remove(entry.path(), error); }
+    }
+}
+
+
+// Download in a child process, its rusage measured by the parent
+Result run_setting(const std::string &url, const Setting &setting, const std::string &output_filename, long long int file_size, int timeout_s, bool verify, bool verbose)
+{
+    Result result = {false, 0, 0, 0, 0, false} ;
+    remove_outputs(output_filename);
+    std::cout.flush();
+    std::fflush(stdout);
+
+    const auto begin = std::chrono::steady_clock::now() ;
+    pid_t pid = fork();
+    if( pid < 0 ){
+        std::cerr << "CO-CURL-BENCH::ERROR -- Cannot fork a run --> " << std::strerror(errno) << std::endl;
+        return result ;
+    }
+    if( pid == 0 ){
+        // Results own stdout, co-curl messages go to stderr (or nowhere)
+        int messages = (verbose) ? STDERR_FILENO : open("/dev/null", O_WRONLY) ;
+        dup2(messages, STDOUT_FILENO);
+
+        cocurl::Options options ;
+        options.num_thread = setting.num_thread ;
+        options.num_part = setting.num_part ;
+        options.chunk_size = setting.chunk_size ;
+        options.direct_write = ( setting.mode == "direct" ) ;
+        options.verbose = verbose ;
+        std::vector<cocurl::Request> requests(1) ;
+        requests[0].url = url ;
+        requests[0].output_filename = output_filename ;
+        if( setting.mode == "stream" ){
+            // Into the output file when verified, it is written in order like stdout
+            options.stream_fd = (verify) ? open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : open("/dev/null", O_WRONLY) ;
+            requests[0].output_filename = "-" ;
+        }
+        bool completed = true ;
+        if( setting.mode == "parts" ){
+            // Every part through its own download(), as separate co-curl -s runs would, then -m
+            const int num_part = (setting.num_part > 0) ? setting.num_part : (setting.chunk_size > 0) ? static_cast<int>((file_size - 1)/setting.chunk_size + 1) : setting.num_thread ;
+            #pragma omp parallel for num_threads(setting.num_thread) schedule(dynamic) reduction(&&:completed)
+            for(int i=0 ; i<num_part ; ++i){
+                cocurl::Downloader part_downloader(options);
+                completed = part_downloader.download_part(url, output_filename, i) && completed ;
+            }
+            cocurl::Downloader downloader(options);
+            completed = completed && downloader.merge_parts(url, output_filename) ;
+        }else{
+            cocurl::Downloader downloader(options);
+            completed = downloader.download(requests) ;
+        }
+        std::fflush(stdout);
+        _exit( (completed) ? 0:1 );
+    }
+
+    int status = 0 ;
+    struct rusage usage ;
+    while( true ){
+        pid_t done = wait4(pid, &status, WNOHANG, &usage);
+        if( done == pid || (done < 0 && errno != EINTR) ){ break; }
+        if( std::chrono::steady_clock::now() - begin > std::chrono::seconds(timeout_s) ){
+            kill(pid, SIGKILL);
+            while( wait4(pid, &status, 0, &usage) < 0 && errno == EINTR ){}
+            result.timed_out = true ;
+            std::cerr << "CO-CURL-BENCH::ERROR -- Run killed after " << timeout_s << " s." << std::endl;
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_INTERVAL_MS));
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() ;
+    result.user_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1E6 ;
+    result.sys_s = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1E6 ;
+    result.peak_rss_mb = usage.ru_maxrss/1024.0 ;  // KB on Linux
+    result.ok = !result.timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0 ;
+    if( result.ok && verify ){
+        result.ok = verify_file(output_filename, file_size) ;
+        if( !result.ok ){ std::cerr << "CO-CURL-BENCH::ERROR -- '" << output_filename << "' does not match the served file." << std::endl; }
+    }
+    remove_outputs(output_filename);
+
+return result; }
+
+
+// "1,4,8" into positive numbers
+bool parse_list(const std::string &arg, std::vector<long long int> &values)
+{
+    values.clear();
+    std::istringstream items(arg);
+    std::string item ;
+    while( std::getline(items, item, ',') ){
+        if( item.empty() || item.find_first_not_of("0123456789") != std::string::npos || std::atoll(item.c_str()) <= 0 ){ return false ; }
+        values.push_back(std::atoll(item.c_str()));
+    }
+return !values.empty(); }
+
+
+// Setting of a results row --> its lowest MEASURES over the ok runs
+typedef std::map<std::string, std::vector<double>> BestMeasures ;
+
+void keep_best(BestMeasures &best, const std::string &key, const std::vector<double> &measures)
+{
+    auto found = best.find(key) ;
+    if( found == best.end() ){ best[key] = measures ; return ; }
+    for(std::size_t m=0 ; m<measures.size() ; ++m){ found->second[m] = std::min(found->second[m], measures[m]); }
+}
+
+
+// A CSV of earlier results (--baseline), false when unreadable or not one of ours
+bool read_baseline(const std::string &filename, BestMeasures &best)
+{
+    std::ifstream file(filename);
+    std::string line ;
+    if( !std::getline(file, line) ){ return false ; }
+
+    auto split = [](const std::string &text){
+        std::vector<std::string> fields ;
+        std::istringstream items(text);
+        std::string item ;
+        while( std::getline(items, item, ',') ){ fields.push_back(item); }
+        return fields ;
+    };
+    const std::vector<std::string> header = split(line) ;
+    auto index = [&header](const std::string &name){ return static_cast<int>(std::find(header.begin(), header.end(), name) - header.begin()) ; };
+    std::vector<int> key_index, measure_index ;
+    for(int c=0 ; c<NUM_KEY_COLUMNS ; ++c){ key_index.push_back(index(COLUMNS[c])); }
+    for(const std::string &name : MEASURES){ measure_index.push_back(index(name)); }
+    const int ok_index = index("ok") ;
+    for(int c : key_index){ if( c >= static_cast<int>(header.size()) ){ return false ; } }
+    for(int c : measure_index){ if( c >= static_cast<int>(header.size()) ){ return false ; } }
+    if( ok_index >= static_cast<int>(header.size()) ){ return false ; }
+
+    while( std::getline(file, line) ){
+        const std::vector<std::string> fields = split(line) ;
+        if( fields.size() != header.size() ){ return false ; }
+        if( fields[ok_index] != "true" ){ continue; }
+        std::string key ;
+        for(int c : key_index){ key += (key.empty() ? "" : ",") + fields[c] ; }
+        std::vector<double> measures ;
+        for(int c : measure_index){ measures.push_back(std::atof(fields[c].c_str())); }
+        keep_best(best, key, measures);
+    }
+return true; }
+
+
+void print_usage(const std::string &executable_name){
+    std::cout
+    << "Usage: " << executable_name << " [OPTIONS...] \n"
+    << "       " << executable_name << " [OPTIONS...] --suite \n"
+    << "       " << executable_name << " [OPTIONS...] --serve \n"
+    << "       " << executable_name << " --self-test \n"
+    << "Time co-curl's download and merge paths against a local HTTP/1.1 range server,\n"
+    << "one CSV row (or JSON object) per run of every combination of the options below.\n"
+    << "\n"
+    << "OPTIONS:\n"
+    << "  -nth, --num-thread <n,...> numbers of threads (and connections) to try (default: " << DEFAULT_NUM_THREADS << ")\n"
+    << "  -np, --num-part <n,...>    numbers of parts to try\n"
+    << "  -cs, --chunk-size <MB,...> chunk sizes to try, after the -np values\n"
+    << "  -m, --mode <merge,direct,stream,parts> paths to try: part files + merge, -d, -o -,\n"
+    << "                             every part with -s then -m (default: merge)\n"
+    << "  -ft, --fault <name,...|all> server faults to try: none, reset, stall, throttle, 503,\n"
+    << "                             bad-range, no-range (default: none)\n"
+    << "  -fe, --fault-every <num>   fault every <num>-th ranged GET (default: " << DEFAULT_FAULT_EVERY << ")\n"
+    << "  -fs, --fault-stall <s>     length of a stall (default: " << DEFAULT_FAULT_STALL_S << ")\n"
+    << "  -fb, --fault-bandwidth <MB/s> bandwidth of a throttled response (default: " << DEFAULT_FAULT_BANDWIDTH_MB << ")\n"
+    << "  --suite                    regression suite: every fault with merge, direct and parts, verified\n"
+    << "  -bl, --baseline <csv>      fail when the best seconds, cpu_s or peak_rss_mb of a setting exceed\n"
+    << "                             the best of its ok runs in this earlier CSV by more than -tol\n"
+    << "  -tol, --tolerance <%>      allowed excess over --baseline (default: " << DEFAULT_TOLERANCE_PERCENT << ")\n"
+    << "  --serve                    only serve, print the URL of every fault and wait for Ctrl-C\n"
+    << "  --self-test                check crc32c, sha256 and md5 against known answers, then exit\n"
+    << "  -sz, --size <MB>           size of the served file (default: " << DEFAULT_FILE_SIZE_MB << ")\n"
+    << "  -l, --latency <ms>         server delay before every response (default: 0)\n"
+    << "  -bw, --bandwidth <MB/s>    server cap per connection (default: 0, unlimited)\n"
+    << "  -rp, --repeat <num>        runs of every combination (default: 1)\n"
+    << "  -t, --timeout <s>          kill a run after <s> seconds, it fails (default: " << DEFAULT_TIMEOUT_S << ")\n"
+    << "  -f, --format <csv|json>    results format (default: csv)\n"
+    << "  -o, --output <filename>    results file (default: stdout)\n"
+    << "  -dir, --directory <path>   where downloads are written, then removed (default: .)\n"
+    << "  -nv, --no-verify           do not compare downloads with the served bytes\n"
+    << "  -v, --verbose              co-curl messages of every run (to stderr)\n"
+    << "  -h, --help                 print this usage\n"
+    << "\n"
+    << "  NOTE: Every run is a process of its own, cpu_s and peak_rss_mb exclude the server.\n"
+    << "  NOTE: The file is generated from a pattern, the server reads no disk.\n"
+    << "  NOTE: Ranges from byte 0 (the size probe) are never faulty, nor are most retries.\n"
+    << "  NOTE: Exits 1 when a run fails, its output differs from the served file, or a --baseline is exceeded.\n"
+    << std::endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+    std::vector<long long int> num_threads(1, DEFAULT_NUM_THREADS), num_parts, chunk_sizes ;
+    std::vector<std::string> modes(1, "merge") ;
+    std::vector<std::string> faults(1, "none") ;
+    ServerConfig config = {DEFAULT_FILE_SIZE_MB*1000000LL, 0, 0, DEFAULT_FAULT_EVERY, DEFAULT_FAULT_STALL_S, DEFAULT_FAULT_BANDWIDTH_MB*1E6} ;
+    int repeat = 1 ;
+    int timeout_s = DEFAULT_TIMEOUT_S ;
+    bool serve_only = false ;
+    std::string format = "csv" ;
+    std::string results_filename ;
+    std::string directory = "." ;
+    bool verify = true ;
+    bool verbose = false ;
+    bool suite = false ;
+    std::string baseline_filename ;
+    double tolerance = DEFAULT_TOLERANCE_PERCENT/100 ;
+
+    std::string executable_name = argv[0] ;
+    {
+        std::size_t pos = executable_name.find_last_of('/');
+        if( pos != std::string::npos ){
+            executable_name = executable_name.substr(pos+1);
+        }
+    }
+
+    for(int i=1 ; i<argc ; ++i)
+    {
+        std::string arg = argv[i] ;
+        std::string value = (i+1<argc) ? argv[i+1] : "" ;
+        bool valid = true ;
+        if( arg=="-h" || arg=="--help" ){
+            print_usage(executable_name);
+            return 0 ;
+        }else if( arg=="-v" || arg=="--verbose" ){
+            verbose = true ;
+            continue;
+        }else if( arg=="-nv" || arg=="--no-verify" ){
+            verify = false ;
+            continue;
+        }else if( arg=="--suite" ){
+            modes = {"merge", "direct", "parts"} ;
+            faults = FAULTS ;
+            suite = true ;
+            continue;
+        }else if( arg=="--serve" ){
+            serve_only = true ;
+            continue;
+        }else if( arg=="--self-test" ){
+            if( !cocurl::self_test() ){ return 1 ; }
+            std::cout << "CO-CURL-BENCH:: Self-test passed." << std::endl;
+            return 0 ;
+        }else if( i+1>=argc ){
+            valid = false ;
+        }else if( arg=="-nth" || arg=="--num-thread" ){
+            valid = parse_list(value, num_threads) ;
+        }else if( arg=="-np" || arg=="--num-part" ){
+            valid = parse_list(value, num_parts) ;
+        }else if( arg=="-cs" || arg=="--chunk-size" ){
+            valid = parse_list(value, chunk_sizes) ;
+        }else if( arg=="-m" || arg=="--mode" ){
+            modes.clear();
+            std::istringstream items(value);
+            std::string item ;
+            while( std::getline(items, item, ',') ){
+                valid = valid && ( item=="merge" || item=="direct" || item=="stream" || item=="parts" ) ;
+                modes.push_back(item);
+            }
+            valid = valid && !modes.empty() ;
+        }else if( arg=="-ft" || arg=="--fault" ){
+            faults = (value == "all") ? FAULTS : std::vector<std::string>() ;
+            std::istringstream items(value);
+            std::string item ;
+            while( value != "all" && std::getline(items, item, ',') ){
+                valid = valid && std::find(FAULTS.begin(), FAULTS.end(), item) != FAULTS.end() ;
+                faults.push_back(item);
+            }
+            valid = valid && !faults.empty() ;
+        }else if( arg=="-fe" || arg=="--fault-every" ){
+            config.fault_every = std::atoi(value.c_str()) ;
+            valid = ( config.fault_every >= 2 ) ;
+        }else if( arg=="-fs" || arg=="--fault-stall" ){
+            config.fault_stall_s = std::atof(value.c_str()) ;
+            valid = ( config.fault_stall_s >= 0 ) ;
+        }else if( arg=="-fb" || arg=="--fault-bandwidth" ){
+            config.fault_bandwidth = std::atof(value.c_str())*1E6 ;
+            valid = ( config.fault_bandwidth > 0 ) ;
+        }else if( arg=="-t" || arg=="--timeout" ){
+            timeout_s = std::atoi(value.c_str()) ;
+            valid = ( timeout_s > 0 ) ;
+        }else if( arg=="-sz" || arg=="--size" ){
+            config.file_size = std::atoll(value.c_str())*1000000LL ;
+            valid = ( config.file_size > 0 ) ;
+        }else if( arg=="-l" || arg=="--latency" ){
+            config.latency_ms = std::atoi(value.c_str()) ;
+            valid = ( config.latency_ms >= 0 ) ;
+        }else if( arg=="-bw" || arg=="--bandwidth" ){
+            config.bandwidth = std::atof(value.c_str())*1E6 ;
+            valid = ( config.bandwidth >= 0 ) ;
+        }else if( arg=="-rp" || arg=="--repeat" ){
+            repeat = std::atoi(value.c_str()) ;
+            valid = ( repeat > 0 ) ;
+        }else if( arg=="-f" || arg=="--format" ){
+            format = value ;
+            valid = ( format=="csv" || format=="json" ) ;
+        }else if( arg=="-o" || arg=="--output" ){
+            results_filename = value ;
+        }else if( arg=="-dir" || arg=="--directory" ){
+            directory = value ;
+        }else if( arg=="-bl" || arg=="--baseline" ){
+            baseline_filename = value ;
+        }else if( arg=="-tol" || arg=="--tolerance" ){
+            tolerance = std::atof(value.c_str())/100 ;
+            valid = ( tolerance >= 0 ) ;
+        }else{
+            print_usage(executable_name);
+            std::cerr << "CO-CURL-BENCH::ERROR -- Unknown input argument " << arg << std::endl;
+            return 1 ;
+        }
+        if( !valid ){
+            std::cerr << "CO-CURL-BENCH::ERROR -- Invalid or missing value for option " << arg << "." << std::endl;
+            return 1 ;
+        }
+        ++i ;
+    }
+
+    // A suite is only a regression check when every output is compared
+    if( suite ){ verify = true ; }
+
+    BestMeasures baseline ;
+    if( !baseline_filename.empty() && !read_baseline(baseline_filename, baseline) ){
+        std::cerr << "CO-CURL-BENCH::ERROR -- Cannot read the results in '" << baseline_filename << "'." << std::endl;
+        return 1 ;
+    }
+
+    // The layouts to try: every -np, then every -cs, co-curl's own choice when neither is given
+    std::vector<std::pair<int, long long int>> layouts ;
+    for(long long int num_part : num_parts){ layouts.push_back(std::make_pair(static_cast<int>(num_part), -1LL)); }
+    for(long long int chunk_size : chunk_sizes){ layouts.push_back(std::make_pair(-1, chunk_size*1000000LL)); }
+    if( layouts.empty() ){ layouts.push_back(std::make_pair(-1, -1LL)); }
+
+    std::ofstream results_file ;
+    if( !results_filename.empty() ){
+        results_file.open(results_filename);
+        if( !results_file ){
+            std::cerr << "CO-CURL-BENCH::ERROR -- Cannot create '" << results_filename << "'." << std::endl;
+            return 1 ;
+        }
+    }
+    std::ostream &results = (results_filename.empty()) ? std::cout : results_file ;
+
+    int port = 0 ;
+    pid_t server = start_server(config, port);
+    if( server < 0 ){
+        std::cerr << "CO-CURL-BENCH::ERROR -- Cannot start the local server --> " << std::strerror(errno) << std::endl;
+        return 1 ;
+    }
+    const std::string url = "http://127.0.0.1:" + std::to_string(port) + "/" + BENCH_FILENAME ;
+    const std::string output_filename = (fs::path(directory) / BENCH_FILENAME).string() ;
+    std::cerr << "CO-CURL-BENCH:: Serving " << config.file_size/1E6 << " MB at " << url << std::endl;
+    if( serve_only ){
+        for(const std::string &fault : FAULTS){
+            if( fault != "none" ){ std::cerr << "CO-CURL-BENCH::   with " << fault << " faults at " << url << "?fault=" << fault << std::endl; }
+        }
+        waitpid(server, NULL, 0);
+        return 0 ;
+    }
+
+    if( format == "csv" ){
+        for(std::size_t c=0 ; c<COLUMNS.size() ; ++c){ results << (c ? "," : "") << COLUMNS[c] ; }
+        results << std::endl;
+    }else{
+        results << "[" ;
+    }
+
+    int num_failed = 0 ;
+    BestMeasures best ;
+    bool first_row = true ;
+    for(const std::string &fault : faults)
+    for(const std::string &mode : modes)
+    for(long long int num_thread : num_threads)
+    for(const std::pair<int, long long int> &layout : layouts)
+    for(int run=1 ; run<=repeat ; ++run)
+    {
+        Setting setting = {mode, fault, static_cast<int>(num_thread), layout.first, layout.second} ;
+        const std::string run_url = (fault == "none") ? url : url + "?fault=" + fault ;
+        Result r = run_setting(run_url, setting, output_filename, config.file_size, timeout_s, verify, verbose);
+        num_failed += !r.ok ;
+
+        const int num_column = static_cast<int>(COLUMNS.size()) ;
+        std::vector<std::ostringstream> values(num_column) ;
+        values[0] << mode ;
+        values[1] << fault ;
+        values[2] << setting.num_thread ;
+        values[3] << setting.num_part ;
+        values[4] << ( (setting.chunk_size > 0) ? setting.chunk_size/1E6 : -1 ) ;
+        values[5] << config.file_size/1E6 ;
+        values[6] << config.latency_ms ;
+        values[7] << config.bandwidth/1E6 ;
+        values[8] << run ;
+        values[9] << ( (r.ok) ? "true" : "false" ) ;
+        values[10] << r.seconds ;
+        values[11] << ( (r.ok) ? config.file_size/1E6/r.seconds : 0 ) ;
+        values[12] << r.user_s ;
+        values[13] << r.sys_s ;
+        values[14] << r.user_s + r.sys_s ;
+        values[15] << r.peak_rss_mb ;
+
+        if( format == "csv" ){
+            for(int c=0 ; c<num_column ; ++c){ results << (c ? "," : "") << values[c].str() ; }
+            results << std::endl;
+        }else{
+            results << (first_row ? "\n  {" : ",\n  {") ;
+            for(int c=0 ; c<num_column ; ++c){
+                results << (c ? ", " : "") << "\"" << COLUMNS[c] << "\": " << (c <= 1 ? "\"" + values[c].str() + "\"" : values[c].str()) ;
+            }
+            results << "}" << std::flush;
+        }
+        first_row = false ;
+
+        if( r.ok ){
+            std::string key ;
+            for(int c=0 ; c<NUM_KEY_COLUMNS ; ++c){ key += (c ? "," : "") + values[c].str() ; }
+            keep_best(best, key, {r.seconds, r.user_s + r.sys_s, r.peak_rss_mb});
+        }
+    }
+    if( format == "json" ){ results << "\n]" << std::endl; }
+
+    int num_regressed = 0 ;
+    for(const auto &setting : best){
+        if( baseline_filename.empty() ){ continue; }
+        auto found = baseline.find(setting.first) ;
+        if( found == baseline.end() ){
+            std::cerr << "CO-CURL-BENCH::WARNING -- No ok run of " << setting.first << " in '" << baseline_filename << "'." << std::endl;
+            continue;
+        }
+        for(std::size_t m=0 ; m<MEASURES.size() ; ++m){
+            if( setting.second[m] > found->second[m]*(1 + tolerance) ){
+                std::cerr << "CO-CURL-BENCH::ERROR -- " << setting.first << ": " << MEASURES[m] << " " << setting.second[m]
+                          << " exceeds the baseline " << found->second[m] << " by more than " << tolerance*100 << "%." << std::endl;
+                ++num_regressed ;
+            }
+        }
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    if( num_failed > 0 ){ std::cerr << "CO-CURL-BENCH::ERROR -- " << num_failed << " runs failed." << std::endl; }
+    if( num_regressed > 0 ){ std::cerr << "CO-CURL-BENCH::ERROR -- " << num_regressed << " measures exceeded the baseline." << std::endl; }
+
+return (num_failed == 0 && num_regressed == 0) ? 0:1 ; }
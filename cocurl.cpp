@@ -0,0 +1,4027 @@
+/******************************************************************
+*
+*  libco-curl (Concurrent cURL library)
+*
+*  Download files concurrently over ranged requests
+*  by splitting them into parts then merge
+*
+*  Copyright (c) 2024, Somrath Kanoksirirath.
+*  All rights reserved under BSD 3-clause license.
+*
+*  g++ -Wall -Wextra -c -fPIC ./cocurl.cpp -fopenmp && ar rcs libco-curl.a cocurl.o
+*
+******************************************************************/
+
+// Note:
+// 1) Download to file = this implementation   --> CURLOPT_WRITEFUNCTION, CURLOPT_WRITEDATA
+//    a) Part files then merge (default)       --> output.partN + merge_files()
+//    b) Direct write (-d,--direct)             --> preallocated output + pwrite() at start+offset
+//       Pros: No merge, no 2x disk space/IO
+//       Cons: No part files to be checked or re-merged later
+// 2) Stream to stdout (-o -)                  --> ring buffer of --max-buffer bytes + write() in byte order
+//    Pros: No disk at all, output can be piped
+//    Cons: Ranges far ahead of the written output wait, no journal to resume
+// 3) Checksum while receiving                 --> CRC-32C per transfer then crc32c_combine() in offset order
+//                                                 SHA-256 / MD5 over the in-order prefix, out-of-order bytes re-read once
+// 4) Download to a Sink (library)             --> Sink::write() at offset, no journal
+//    Pros: Memory, caller's file descriptor or callback, nothing on disk unless the sink writes it
+//    Cons: Sink::read() needed to verify sha256 / md5, no resume
+
+#include <filesystem>
+namespace fs = std::filesystem ;
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <vector>
+#include <set>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <cstdint>
+#include <cmath>
+#include <omp.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include <curl/curl.h>
+
+#include "cocurl.hpp"
+
+namespace cocurl {
+
+constexpr int POLL_TIMEOUT_MS = 1000 ;
+constexpr int DEFAULT_UNITS_PER_CONNECTION = 4 ;
+constexpr int PROBE_UNIT_SIZE = 4E6 ;
+constexpr int JOURNAL_SYNC_INTERVAL_S = 5 ;
+constexpr int READ_BACK_SIZE = 1<<20 ;
+constexpr int MERGE_BUFFER_SIZE = 1<<23 ;
+constexpr int PART_ALIGNMENT = 1<<12 ;      // Filesystem block, parts at multiples of it can be reflinked
+constexpr int MIN_FILE_SIZE_FOR_PARALLEL = 1E3 ;
+constexpr int NUM_TRY_DOWNLOAD = 5 ;
+constexpr int RETRY_BASE_DELAY_MS = 500 ;
+constexpr int RETRY_MAX_DELAY_MS = 30000 ;
+constexpr double MIRROR_RATE_WEIGHT = 0.3 ;
+constexpr int AUTO_START_CONNECTIONS = 2 ;
+constexpr int AUTO_WINDOW_MS = 2000 ;
+constexpr double AUTO_MIN_GAIN = 0.05 ;
+constexpr int AUTO_HOLD_WINDOWS = 5 ;
+constexpr int AUTO_MAX_FAILURE_RATIO = 4 ;  // Back off when 1 in 4 attempts fails
+constexpr int UNIT_TARGET_S = 5 ;
+constexpr int PROFILE_MAX_AGE_DAYS = 30 ;
+constexpr int PROGRESS_INTERVAL_MS = 200 ;
+constexpr double PROGRESS_RATE_WEIGHT = 0.3 ;
+constexpr double STRAGGLER_RATIO = 0.25 ;    // Below a quarter of the median connection rate
+constexpr int STRAGGLER_MIN_AGE_MS = 2000 ;
+constexpr int MAX_RANGES_PER_REQUEST = 32 ;   // Servers cap or refuse long Range lists
+constexpr double RATE_BURST_S = 0.25 ;        // Default bucket of the rate limit
+constexpr int MIN_RATE_BURST = 1<<16 ;
+constexpr int RATE_SCHEDULE_CHECK_MS = 1000 ;
+
+struct Account {
+    std::string username ;
+    std::string password ;
+};
+
+// Rate of the first window containing the local time 'now', 'rate' outside them
+long long int scheduled_rate(const long long int rate, const std::vector<RateWindow> &schedule, const std::time_t now)
+{
+    std::tm local ;
+    if( schedule.empty() || !localtime_r(&now, &local) ){ return rate ; }
+    const int minute = local.tm_hour*60 + local.tm_min ;
+    for(const RateWindow &w : schedule){
+        bool inside = (w.begin_minute < w.end_minute) ? (minute >= w.begin_minute && minute < w.end_minute)
+                                                       : (minute >= w.begin_minute || minute < w.end_minute) ;
+        if( inside ){ return w.rate ; }
+    }
+return rate; }
+
+
+// Token bucket over all transfers of the multi engine, of an AsyncClient or of download_range(),
+// refilled at the rate of the schedule. The engines use it from their one thread, download_range()
+// of several threads (RemoteFile) through wait_for_tokens() and spend_tokens(), under 'lock'.
+// Spending may go below zero (a whole write callback is accepted), the debt is paid before the next bytes.
+struct RateLimit {
+    long long int rate = 0 ;    // Bytes/s outside the schedule, 0 --> unlimited
+    long long int burst = -1 ;  // Bucket size, -1 --> RATE_BURST_S at the current rate
+    std::vector<RateWindow> schedule ;
+    long long int current = 0 ; // Rate in effect, 0 --> unlimited
+    double tokens = 0.0 ;
+    std::chrono::steady_clock::time_point last ;
+    std::chrono::steady_clock::time_point next_check ;
+    std::mutex lock ;
+
+    bool enabled() const { return rate > 0 || !schedule.empty() ; }
+
+    void refill(){
+        const auto now = std::chrono::steady_clock::now();
+        const bool first = ( last == std::chrono::steady_clock::time_point() ) ;
+        if( now >= next_check ){
+            current = scheduled_rate(rate, schedule, std::time(NULL)) ;
+            next_check = now + std::chrono::milliseconds(RATE_SCHEDULE_CHECK_MS) ;
+        }
+        const double capacity = (burst > 0) ? burst : std::max(current*RATE_BURST_S, static_cast<double>(MIN_RATE_BURST)) ;
+        tokens = (first) ? capacity : std::min(tokens + current*std::chrono::duration<double>(now - last).count(), capacity) ;
+        last = now ;
+    }
+
+    bool allow() const { return current <= 0 || tokens > 0.0 ; }
+
+    void spend(const long long int bytes){ if( current > 0 ){ tokens -= bytes ; } }
+
+    // Until the debt is paid
+    int wait_ms() const {
+        if( allow() ){ return 0 ; }
+        return static_cast<int>(std::ceil(-tokens*1E3/current)) + 1 ;
+    }
+};
+
+
+// State shared by all transfers: DNS cache, TLS sessions, connection pool and rate limit
+struct Session {
+    Account user ;
+    CURLSH *share = NULL ;
+    std::mutex locks[CURL_LOCK_DATA_LAST] ;
+    const CancellationToken *cancellation = NULL ;
+    RateLimit limit ;
+};
+
+bool cancelled(const Session &session){ return session.cancellation && session.cancellation->cancelled() ; }
+
+// A blocking connection waits for the rate limit here, the socket is not read meanwhile
+void wait_for_tokens(RateLimit &limit, const Session &session)
+{
+    std::unique_lock<std::mutex> lock(limit.lock);
+    limit.refill();
+    while( !limit.allow() && !cancelled(session) ){
+        const int wait_ms = std::min(limit.wait_ms(), POLL_TIMEOUT_MS) ;
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+        lock.lock();
+        limit.refill();
+    }
+}
+
+void spend_tokens(RateLimit &limit, const long long int bytes)
+{
+    std::lock_guard<std::mutex> lock(limit.lock);
+    limit.spend(bytes);
+}
+
+// Completed inclusive byte ranges, kept sorted and disjoint
+struct ByteMap {
+    std::vector<std::pair<long long int, long long int>> ranges ;
+
+    void add(long long int start, long long int end){
+        auto it = ranges.begin();
+        while( it != ranges.end() && it->second + 1 < start ){ ++it; }
+        while( it != ranges.end() && it->first <= end + 1 ){
+            start = std::min(start, it->first);
+            end = std::max(end, it->second);
+            it = ranges.erase(it);
+        }
+        ranges.insert(it, std::make_pair(start, end));
+    }
+
+    long long int covered() const {
+        long long int total = 0 ;
+        for(const auto &r : ranges){ total += r.second - r.first + 1 ; }
+        return total ;
+    }
+};
+
+
+// Sidecar file recording durably written byte ranges, for resuming
+struct Journal {
+    std::string filename ;
+    std::string header ;    // Identifies the remote file and the output layout
+    ByteMap done ;
+    std::chrono::steady_clock::time_point last_sync ;
+};
+
+
+struct WriteTarget {
+    int fd ;                // Destination file descriptor
+    Sink *sink ;            // Destination instead of fd, NULL --> fd
+    long long int offset ;  // File offset of the next received byte
+    long long int first ;   // Remote position of the first byte of this attempt
+    long long int position ;// Remote position of the next received byte
+    Journal *journal ;      // NULL --> not journaled
+    long long int last ;    // Remote position of the last byte asked for
+    long long int range_start ; // Content-Range of the response, -1 --> none
+    const Session *session ;
+    RateLimit *limit ;      // NULL --> unlimited
+    CURL *curl ;
+    bool bad_range ;        // Whole file (200) instead of the range asked for
+    bool wrong_range ;      // 206 starting elsewhere than asked
+    bool truncated ;        // Bytes beyond 'last' were discarded
+};
+
+
+std::string getHttpStatusMessage(long response_code)
+{
+    switch (response_code) {
+        case 100: return "100 Continue.";
+        case 101: return "101 Switching Protocols.";
+        case 200: return "200 OK.";
+        case 201: return "201 Created.";
+        case 202: return "202 Accepted.";
+        case 204: return "204 No Content.";
+        case 206: return "206 Partial Content.";
+        case 301: return "301 Moved Permanently.";
+        case 302: return "302 Found.";
+        case 304: return "304 Not Modified.";
+        case 400: return "400 Bad Request.";
+        case 401: return "401 Unauthorized.";
+        case 403: return "403 Forbidden.";
+        case 404: return "404 Not Found.";
+        case 405: return "405 Method Not Allowed.";
+        case 408: return "408 Request Timeout.";
+        case 409: return "409 Conflict.";
+        case 416: return "416 Range Not Satisfiable.";
+        case 429: return "429 Too Many Requests.";
+        case 500: return "500 Internal Server Error.";
+        case 501: return "501 Not Implemented.";
+        case 502: return "502 Bad Gateway.";
+        case 503: return "503 Service Unavailable.";
+        case 504: return "504 Gateway Timeout.";
+        case 505: return "505 HTTP Version Not Supported.";
+        default:  return std::to_string(response_code) + " Unknown Response Code.";
+    }
+}
+
+
+// Server-side conditions worth retrying, the rest (403, 404, ...) will not change
+bool is_transient_http_error(long response_code)
+{
+    return response_code == 408 || response_code == 429 || response_code == 500
+        || response_code == 502 || response_code == 503 || response_code == 504 ;
+}
+
+
+// Exponential backoff with jitter, attempt = 1, 2, ...
+std::chrono::milliseconds retry_delay(int attempt)
+{
+    thread_local std::mt19937 rng(std::random_device{}());
+    long long int delay = RETRY_BASE_DELAY_MS ;
+    for(int i=1 ; i<attempt && delay<RETRY_MAX_DELAY_MS ; ++i){ delay *= 2 ; }
+    delay = std::min(delay, static_cast<long long int>(RETRY_MAX_DELAY_MS));
+    std::uniform_int_distribution<long long int> jitter(delay/2, delay);
+
+return std::chrono::milliseconds(jitter(rng)); }
+
+
+void lock_share(CURL*, curl_lock_data data, curl_lock_access, void *userptr){
+    static_cast<Session*>(userptr)->locks[data].lock();
+}
+
+void unlock_share(CURL*, curl_lock_data data, void *userptr){
+    static_cast<Session*>(userptr)->locks[data].unlock();
+}
+
+
+// After curl_global_init(), share handle failure only costs performance
+void init_session(Session &session)
+{
+    session.share = curl_share_init();
+    if( !session.share ){
+        std::cerr << "CO-CURL::WARNING -- Cannot initialize cURL share interface, connections will not be reused across transfers." << std::endl;
+        return;
+    }
+    curl_share_setopt(session.share, CURLSHOPT_LOCKFUNC, lock_share);
+    curl_share_setopt(session.share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+    curl_share_setopt(session.share, CURLSHOPT_USERDATA, &session);
+    curl_share_setopt(session.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(session.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(session.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+
+// All easy handles must be cleaned up before
+void cleanup_session(Session &session)
+{
+    if( session.share ){ curl_share_cleanup(session.share); }
+    session.share = NULL ;
+}
+
+
+void setup_transfer(CURL *curl, Session &session, const std::string &url)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L); // No error page written into the output
+    if( session.share ){
+        curl_easy_setopt(curl, CURLOPT_SHARE, session.share);
+    }
+    if( !session.user.username.empty() ){
+        curl_easy_setopt(curl, CURLOPT_USERNAME, session.user.username.c_str());
+    }
+    if( !session.user.password.empty() ){
+        curl_easy_setopt(curl, CURLOPT_PASSWORD, session.user.password.c_str());
+    }
+}
+
+
+long long int get_file_size(Session &session, const std::string &url, bool verbose)
+{
+    CURL *curl ;
+    curl_off_t file_size = 0 ;
+    long response_code ;
+
+    curl = curl_easy_init();
+    if( curl ){
+        setup_transfer(curl, session, url);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 0L);
+
+        if( curl_easy_perform(curl) == CURLE_OK ){
+            if( curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &file_size) != CURLE_OK ){
+                file_size = -1 ;
+                std::cerr << "CO-CURL::ERROR -- Cannot acquire remote file size." << std::endl;
+            }
+            if( file_size == 0 ){
+                file_size = -1 ;
+                std::cerr << "CO-CURL::ERROR -- Remote file is empty (0 bytes)." << std::endl;
+            }
+            if( curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code) == CURLE_OK ){
+                if( response_code >= 400 ){
+                    file_size = -1 ;
+                    std::cerr << "CO-CURL::ERROR -- " << getHttpStatusMessage(response_code) << std::endl;
+                }else if( verbose ){
+                    std::cout << "CO-CURL:: Get file size -- " << getHttpStatusMessage(response_code) << std::endl;
+                }
+            }
+        }else{
+            file_size = -1 ;
+            std::cerr << "CO-CURL::ERROR -- Cannot acquire remote file information." << std::endl;
+        }
+        curl_easy_cleanup(curl);
+    }else{
+        file_size = -1 ;
+        std::cerr << "CO-CURL::ERROR -- Cannot initialize cURL." << std::endl;
+    }
+
+return static_cast<long long int>(file_size); }
+
+
+std::string journal_header(const std::string &url, const long long int file_size, const int num_part, const long long int chunk_size, bool direct_write)
+{
+    // Direct write does not depend on the part layout
+    if( direct_write ){
+        return "CO-CURL-JOURNAL 1\n" + url + "\n" + std::to_string(file_size) + " direct\n" ;
+    }
+    return "CO-CURL-JOURNAL 1\n" + url + "\n"
+           + std::to_string(file_size) + " " + std::to_string(num_part) + " " + std::to_string(chunk_size) + "\n" ;
+}
+
+
+// Return true when an existing journal matches journal.header
+bool journal_load(Journal &journal)
+{
+    journal.done.ranges.clear();
+    journal.last_sync = std::chrono::steady_clock::now();
+
+    std::ifstream file(journal.filename.c_str());
+    if( !file.is_open() ){ return false ; }
+    std::string header, line ;
+    for(int i=0 ; i<3 && std::getline(file, line) ; ++i){ header += line + "\n" ; }
+    if( header != journal.header ){ return false ; }
+
+    long long int start, end ;
+    while( file >> start >> end ){
+        if( start >= 0 && start <= end ){ journal.done.add(start, end); }
+    }
+
+return true; }
+
+
+// Atomically replace the journal, the data must already be synced
+bool journal_save(Journal &journal)
+{
+    std::string tmp_filename = journal.filename + ".tmp" ;
+    FILE *fp = fopen(tmp_filename.c_str(), "w");
+    if( fp==NULL ){ return false ; }
+
+    std::fputs(journal.header.c_str(), fp);
+    for(const auto &r : journal.done.ranges){
+        std::fprintf(fp, "%lld %lld\n", r.first, r.second);
+    }
+    bool success = ( std::fflush(fp) == 0 && fsync(fileno(fp)) == 0 ) ;
+    success = ( std::fclose(fp) == 0 ) && success ;
+    if( success ){ success = ( std::rename(tmp_filename.c_str(), journal.filename.c_str()) == 0 ) ; }
+    journal.last_sync = std::chrono::steady_clock::now();
+
+return success; }
+
+
+bool journal_due(const Journal &journal)
+{
+    return std::chrono::steady_clock::now() - journal.last_sync >= std::chrono::seconds(JOURNAL_SYNC_INTERVAL_S) ;
+}
+
+
+// First byte at or after start which is not yet durable
+long long int journal_resume(const Journal &journal, const long long int start)
+{
+    for(const auto &r : journal.done.ranges){
+        if( r.first <= start && start <= r.second ){ return r.second + 1 ; }
+    }
+return start; }
+
+
+size_t curl_header_range(char *buffer, size_t size, size_t nitems, WriteTarget *target){
+    const size_t length = size*nitems ;
+    long long int first ;
+    if( length > 5 && std::strncmp(buffer, "HTTP/", 5) == 0 ){
+        target->range_start = -1 ;
+    }else if( length > 14 && strncasecmp(buffer, "content-range:", 14) == 0 && std::sscanf(std::string(buffer + 14, length - 14).c_str(), " bytes %lld-", &first) == 1 ){
+        target->range_start = first ;
+    }
+    return length ;
+}
+
+
+// Positional write capped at target->last, returning short aborts the transfer
+size_t curl_pwrite_data(void *ptr, size_t size, size_t nmemb, WriteTarget *target){
+    const char *data = static_cast<const char*>(ptr);
+    size_t remain = size*nmemb ;
+    if( target->position == target->first ){
+        long response_code = 0 ;
+        curl_easy_getinfo(target->curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if( response_code == 200 && target->first > 0 ){
+            target->bad_range = true ;
+            return 0 ;
+        }
+        if( response_code == 206 && target->range_start != target->first ){
+            target->wrong_range = true ;
+            return 0 ;
+        }
+    }
+    if( target->limit ){ wait_for_tokens(*target->limit, *target->session); }
+    const long long int before = target->position ;
+    if( target->position + static_cast<long long int>(remain) > target->last + 1 ){
+        remain = target->last + 1 - target->position ;
+        target->truncated = true ;
+    }
+    if( target->sink ){
+        if( !target->sink->write(target->offset, data, remain) ){ return 0 ; }
+        target->offset += remain ;
+        target->position += remain ;
+        remain = 0 ;
+    }
+    while( remain > 0 ){
+        ssize_t written = pwrite(target->fd, data, remain, target->offset);
+        if( written < 0 ){
+            if( errno == EINTR ){ continue; }
+            return 0 ; // Abort transfer --> CURLE_WRITE_ERROR
+        }
+        data += written ;
+        remain -= written ;
+        target->offset += written ;
+        target->position += written ;
+    }
+    if( target->limit ){ spend_tokens(*target->limit, target->position - before); }
+    if( target->journal && journal_due(*target->journal) ){
+        if( fdatasync(target->fd) == 0 ){
+            target->journal->done.add(target->first, target->position - 1);
+            journal_save(*target->journal);
+        }
+    }
+    if( cancelled(*target->session) || target->truncated ){ return 0 ; }
+    return size*nmemb;
+}
+
+
+bool preallocate_file(int fd, long long int file_size)
+{
+    if( fallocate(fd, 0, 0, file_size) == 0 ){ return true ; }
+    // Filesystem without fallocate support (e.g. NFS, tmpfs on old kernels) --> sparse file
+    if( errno == EOPNOTSUPP || errno == ENOSYS ){
+        return ftruncate(fd, file_size) == 0 ;
+    }
+return false; }
+
+
+// Download inclusive range [start, end] of url into fd (or sink) at offset 'offset'
+// A failed attempt is retried, after a backoff, from the first byte not yet received
+// (or not yet durable according to the journal when rerunning).
+// Under a rate limit the write callback waits for the tokens, the schedule followed as it goes.
+bool download_range(Session &session, int fd, long long int offset, const std::string &output_filename, const std::string &url, const long long int start, const long long int end, Journal *journal, bool verbose, Sink *sink = NULL)
+{
+    CURL *curl ;
+    CURLcode res ;
+    long response_code ;
+    bool success = false ;
+    std::string range ;
+    WriteTarget target ;
+    int num_whole_file = 0 ;   // Twice --> the server ignores ranges, not a transient error
+
+    curl = curl_easy_init();
+    if( curl ){
+        setup_transfer(curl, session, url);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_range);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &target);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_pwrite_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, !verbose);
+        curl_easy_setopt(curl, CURLOPT_VERBOSE, verbose);
+
+        long long int resume = (journal) ? journal_resume(*journal, start) : start ;
+        for(int i=0 ; i<NUM_TRY_DOWNLOAD && !cancelled(session) ; ++i)
+        {
+            if( resume > end ){
+                success = true ;
+                break;
+            }
+            if( i > 0 ){
+                std::chrono::milliseconds delay = retry_delay(i);
+                std::printf("CO-CURL:: Retrying '%s' from byte %lld in %.1f s.\n", output_filename.c_str(), resume, delay.count()/1E3);
+                std::this_thread::sleep_for(delay);
+            }else if( resume > start && verbose ){
+                std::printf("CO-CURL:: Resuming '%s' from byte %lld.\n", output_filename.c_str(), resume);
+            }
+            range = std::to_string(resume) + "-" + std::to_string(end) ;
+            curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+            target.fd = fd ;
+            target.sink = sink ;
+            target.offset = offset + (resume - start) ;
+            target.first = resume ;
+            target.position = resume ;
+            target.last = end ;
+            target.range_start = -1 ;
+            target.journal = journal ;
+            target.session = &session ;
+            target.limit = (session.limit.enabled()) ? &session.limit : NULL ;
+            target.curl = curl ;
+            target.bad_range = false ;
+            target.wrong_range = false ;
+            target.truncated = false ;
+            res = curl_easy_perform(curl); // *** Main cURL: download ***
+
+            if( journal && target.position > resume && fdatasync(fd) == 0 ){
+                journal->done.add(resume, target.position - 1);
+                journal_save(*journal);
+            }
+            // Keep retrying as long as attempts make progress
+            if( target.position - resume >= MIN_UNIT_SIZE ){ i = 0 ; }
+            resume = target.position ;
+
+            response_code = 0 ;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+            if( target.bad_range && ++num_whole_file > 1 ){
+                std::printf("CO-CURL::ERROR -- Server does not support ranged requests, cannot download bytes %lld-%lld of '%s'.\n", resume, end, output_filename.c_str());
+                break;
+            }else if( target.bad_range ){
+                std::printf("CO-CURL::ERROR -- Server sent the whole file instead of bytes %lld-%lld of '%s' (%d)\n", resume, end, output_filename.c_str(), i);
+            }else if( target.wrong_range ){
+                std::printf("CO-CURL::ERROR -- Server did not honor range %s of '%s' (%d)\n", range.c_str(), output_filename.c_str(), i);
+            }else if( response_code >= 400 ){
+                std::printf("CO-CURL::ERROR -- Cannot download '%s' (%d)\n --> %s\n", output_filename.c_str(), i, curl_easy_strerror(res));
+                std::printf("CO-CURL::ERROR -- %s.\n", getHttpStatusMessage(response_code).c_str());
+                if( is_transient_http_error(response_code) ){ continue; }
+                break;
+            }else if( res == CURLE_OK || (res == CURLE_WRITE_ERROR && target.truncated) ){
+                if( verbose ){
+                    std::printf("CO-CURL:: Download -- %s.\n", getHttpStatusMessage(response_code).c_str());
+                }
+                success = ( target.position == end + 1 ) ;
+                if( !success ){
+                    std::printf("CO-CURL::ERROR -- Received %lld of %lld bytes for '%s' (%d)\n", target.position - target.first, end - target.first + 1, output_filename.c_str(), i);
+                    continue;
+                }
+                break;
+            }else{
+                std::printf("CO-CURL::ERROR -- Cannot download '%s' (%d)\n --> %s\n", output_filename.c_str(), i, curl_easy_strerror(res));
+            }
+        }
+
+        curl_easy_cleanup(curl);
+
+    }else{
+        std::printf("CO-CURL::ERROR -- Cannot initialize cURL for downloading '%s'\n", output_filename.c_str());
+    }
+
+return success; }
+
+
+// Download [start, end] into output_filename, resuming from its journal if any
+bool download(Session &session, const std::string &output_filename, const std::string &url, const long long int start, const long long int end, const std::string &header, bool verbose)
+{
+    Journal journal ;
+    journal.filename = output_filename + ".journal" ;
+    journal.header = header ;
+    bool use_journal = !header.empty() ;
+    bool resume = use_journal && journal_load(journal) ;
+
+    int fd = open(output_filename.c_str(), O_WRONLY | O_CREAT | ((resume) ? 0 : O_TRUNC), 0644);
+    if( fd < 0 ){
+        std::printf("CO-CURL::ERROR -- Cannot create '%s'\n --> %s\n", output_filename.c_str(), std::strerror(errno));
+        return false ;
+    }
+
+    bool success = download_range(session, fd, 0, output_filename, url, start, end, (use_journal) ? &journal : NULL, verbose);
+    close(fd);
+    if( success ){
+        if( use_journal ){ std::remove(journal.filename.c_str()); }
+    }else if( use_journal && !journal.done.ranges.empty() ){
+        std::printf("CO-CURL:: Keeping '%s' to resume on rerun.\n", journal.filename.c_str());
+    }else{
+        std::remove(output_filename.c_str());
+        if( use_journal ){ std::remove(journal.filename.c_str()); }
+    }
+
+return success; }
+
+
+// CRC-32C (Castagnoli), reflected, as in zlib's crc32(): crc32c(0, data, n) then chain
+constexpr uint32_t CRC32C_POLY = 0x82F63B78 ;
+
+struct Crc32cTable {
+    uint32_t t[8][256] ;
+    Crc32cTable(){
+        for(uint32_t n=0 ; n<256 ; ++n){
+            uint32_t c = n ;
+            for(int k=0 ; k<8 ; ++k){ c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1 ; }
+            t[0][n] = c ;
+        }
+        for(uint32_t n=0 ; n<256 ; ++n){
+            for(int k=1 ; k<8 ; ++k){ t[k][n] = (t[k-1][n] >> 8) ^ t[0][t[k-1][n] & 0xFF] ; }
+        }
+    }
+};
+
+// Slicing-by-8 fallback
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, std::size_t n)
+{
+    static const Crc32cTable table ;
+    while( n >= 8 ){
+        uint64_t v ;
+        std::memcpy(&v, p, 8);
+        v ^= crc ;
+        crc = table.t[7][v & 0xFF] ^ table.t[6][(v >> 8) & 0xFF] ^ table.t[5][(v >> 16) & 0xFF] ^ table.t[4][(v >> 24) & 0xFF]
+            ^ table.t[3][(v >> 32) & 0xFF] ^ table.t[2][(v >> 40) & 0xFF] ^ table.t[1][(v >> 48) & 0xFF] ^ table.t[0][v >> 56] ;
+        p += 8 ;
+        n -= 8 ;
+    }
+    while( n-- ){ crc = (crc >> 8) ^ table.t[0][(crc ^ *p++) & 0xFF] ; }
+
+return crc; }
+
+#if defined(__x86_64__)
+// SSE4.2 crc32 instruction, 8 bytes per step
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, std::size_t n)
+{
+    uint64_t c = crc ;
+    while( n >= 8 ){
+        uint64_t v ;
+        std::memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8 ;
+        n -= 8 ;
+    }
+    crc = static_cast<uint32_t>(c);
+    while( n-- ){ crc = _mm_crc32_u8(crc, *p++); }
+
+return crc; }
+#endif
+
+uint32_t crc32c(uint32_t crc, const char *data, std::size_t n)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    static const bool sse42 = __builtin_cpu_supports("sse4.2") ;
+    if( sse42 ){ return ~crc32c_sse42(~crc, p, n) ; }
+#endif
+return ~crc32c_table(~crc, p, n); }
+
+
+uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0 ;
+    for( ; vec ; vec >>= 1, ++mat ){ if( vec & 1 ){ sum ^= *mat ; } }
+
+return sum; }
+
+void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for(int n=0 ; n<32 ; ++n){ square[n] = gf2_matrix_times(mat, mat[n]); }
+}
+
+// CRC of A followed by B from crc(A), crc(B) and len(B), as zlib's crc32_combine()
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, long long int len2)
+{
+    if( len2 <= 0 ){ return crc1 ; }
+    uint32_t even[32], odd[32] ;
+    odd[0] = CRC32C_POLY ;
+    for(int n=1 ; n<32 ; ++n){ odd[n] = 1u << (n-1) ; }
+    gf2_matrix_square(even, odd);  // 2 zero bits
+    gf2_matrix_square(odd, even);  // 4 zero bits
+    do{
+        gf2_matrix_square(even, odd);
+        if( len2 & 1 ){ crc1 = gf2_matrix_times(even, crc1); }
+        len2 >>= 1 ;
+        if( !len2 ){ break; }
+        gf2_matrix_square(odd, even);
+        if( len2 & 1 ){ crc1 = gf2_matrix_times(odd, crc1); }
+        len2 >>= 1 ;
+    }while( len2 );
+
+return crc1 ^ crc2; }
+
+
+// FIPS 180-4
+struct Sha256 {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19} ;
+    unsigned char block[64] ;
+    std::size_t fill = 0 ;
+    uint64_t length = 0 ;
+
+    static uint32_t rotr(uint32_t x, int n){ return (x >> n) | (x << (32 - n)) ; }
+
+    void transform(const unsigned char *p){
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2} ;
+        uint32_t w[64] ;
+        for(int i=0 ; i<16 ; ++i){ w[i] = (uint32_t(p[4*i]) << 24) | (uint32_t(p[4*i+1]) << 16) | (uint32_t(p[4*i+2]) << 8) | p[4*i+3] ; }
+        for(int i=16 ; i<64 ; ++i){
+            uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3) ;
+            uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10) ;
+            w[i] = w[i-16] + s0 + w[i-7] + s1 ;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7] ;
+        for(int i=0 ; i<64 ; ++i){
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i] ;
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c)) ;
+            hh = g ; g = f ; f = e ; e = d + t1 ; d = c ; c = b ; b = a ; a = t1 + t2 ;
+        }
+        h[0] += a ; h[1] += b ; h[2] += c ; h[3] += d ; h[4] += e ; h[5] += f ; h[6] += g ; h[7] += hh ;
+    }
+
+    void update(const char *data, std::size_t n){
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+        length += n ;
+        while( n > 0 ){
+            if( fill == 0 && n >= 64 ){
+                transform(p);
+                p += 64 ;
+                n -= 64 ;
+                continue;
+            }
+            std::size_t take = std::min(n, 64 - fill);
+            std::memcpy(block + fill, p, take);
+            fill += take ;
+            p += take ;
+            n -= take ;
+            if( fill == 64 ){ transform(block); fill = 0 ; }
+        }
+    }
+
+    std::string final(){
+        uint64_t bits = length*8 ;
+        const char pad = static_cast<char>(0x80), zero = 0 ;
+        update(&pad, 1);
+        while( fill != 56 ){ update(&zero, 1); }
+        unsigned char tail[8] ;
+        for(int i=0 ; i<8 ; ++i){ tail[i] = static_cast<unsigned char>(bits >> (56 - 8*i)); }
+        update(reinterpret_cast<const char*>(tail), 8);
+        std::string digest ;
+        for(uint32_t v : h){ for(int i=3 ; i>=0 ; --i){ digest += static_cast<char>(v >> (8*i)); } }
+        return digest ;
+    }
+};
+
+
+// RFC 1321, for Content-MD5 and MD5 ETags
+struct Md5 {
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476} ;
+    unsigned char block[64] ;
+    std::size_t fill = 0 ;
+    uint64_t length = 0 ;
+
+    static uint32_t rotl(uint32_t x, int n){ return (x << n) | (x >> (32 - n)) ; }
+
+    void transform(const unsigned char *p){
+        static const uint32_t k[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391} ;
+        static const int r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21} ;
+        uint32_t m[16] ;
+        for(int i=0 ; i<16 ; ++i){ m[i] = p[4*i] | (uint32_t(p[4*i+1]) << 8) | (uint32_t(p[4*i+2]) << 16) | (uint32_t(p[4*i+3]) << 24) ; }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3] ;
+        for(int i=0 ; i<64 ; ++i){
+            uint32_t f ;
+            int g ;
+            if( i < 16 ){      f = (b & c) | (~b & d) ; g = i ; }
+            else if( i < 32 ){ f = (d & b) | (~d & c) ; g = (5*i + 1) % 16 ; }
+            else if( i < 48 ){ f = b ^ c ^ d ;           g = (3*i + 5) % 16 ; }
+            else{              f = c ^ (b | ~d) ;        g = (7*i) % 16 ; }
+            uint32_t t = d ;
+            d = c ;
+            c = b ;
+            b = b + rotl(a + f + k[i] + m[g], r[4*(i/16) + i%4]);
+            a = t ;
+        }
+        h[0] += a ; h[1] += b ; h[2] += c ; h[3] += d ;
+    }
+
+    void update(const char *data, std::size_t n){
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+        length += n ;
+        while( n > 0 ){
+            if( fill == 0 && n >= 64 ){
+                transform(p);
+                p += 64 ;
+                n -= 64 ;
+                continue;
+            }
+            std::size_t take = std::min(n, 64 - fill);
+            std::memcpy(block + fill, p, take);
+            fill += take ;
+            p += take ;
+            n -= take ;
+            if( fill == 64 ){ transform(block); fill = 0 ; }
+        }
+    }
+
+    std::string final(){
+        uint64_t bits = length*8 ;
+        const char pad = static_cast<char>(0x80), zero = 0 ;
+        update(&pad, 1);
+        while( fill != 56 ){ update(&zero, 1); }
+        unsigned char tail[8] ;
+        for(int i=0 ; i<8 ; ++i){ tail[i] = static_cast<unsigned char>(bits >> (8*i)); }
+        update(reinterpret_cast<const char*>(tail), 8);
+        std::string digest ;
+        for(uint32_t v : h){ for(int i=0 ; i<4 ; ++i){ digest += static_cast<char>(v >> (8*i)); } }
+        return digest ;
+    }
+};
+
+
+std::string to_hex(const std::string &bytes)
+{
+    static const char digits[] = "0123456789abcdef" ;
+    std::string hex ;
+    for(unsigned char c : bytes){
+        hex += digits[c >> 4] ;
+        hex += digits[c & 0xF] ;
+    }
+
+return hex; }
+
+
+// Hex of a base64 value, empty when malformed
+std::string base64_to_hex(const std::string &value)
+{
+    static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/" ;
+    std::string bytes ;
+    uint32_t bits = 0 ;
+    int num_bits = 0 ;
+    for(char c : value){
+        if( c == '=' ){ break; }
+        std::size_t v = alphabet.find(c);
+        if( v == std::string::npos ){ return "" ; }
+        bits = (bits << 6) | static_cast<uint32_t>(v) ;
+        num_bits += 6 ;
+        if( num_bits >= 8 ){
+            num_bits -= 8 ;
+            bytes += static_cast<char>((bits >> num_bits) & 0xFF);
+        }
+    }
+
+return to_hex(bytes); }
+
+
+// Expected digest of a whole file, from --checksum or the server
+struct Checksum {
+    std::string algorithm ;  // "crc32c", "sha256", "md5" or empty
+    std::string expected ;   // Lowercase hex, empty --> only report
+    std::string source ;     // Where 'expected' comes from
+    bool advisory = false ;  // A mismatch only warns (ETag need not be a digest)
+};
+
+
+// "<algorithm>[:<hex>]" as given to --checksum
+bool parse_checksum(const std::string &arg, Checksum &checksum)
+{
+    std::size_t pos = arg.find(':');
+    checksum.algorithm = arg.substr(0, pos);
+    checksum.expected = (pos == std::string::npos) ? "" : arg.substr(pos + 1) ;
+    std::transform(checksum.expected.begin(), checksum.expected.end(), checksum.expected.begin(), ::tolower);
+    checksum.source = "--checksum" ;
+    std::size_t digits = 0 ;
+    if( checksum.algorithm == "crc32c" ){ digits = 8 ; }
+    else if( checksum.algorithm == "sha256" ){ digits = 64 ; }
+    else if( checksum.algorithm == "md5" ){ digits = 32 ; }
+    else{ return false ; }
+
+return checksum.expected.empty() || ( checksum.expected.size() == digits && checksum.expected.find_first_not_of("0123456789abcdef") == std::string::npos ) ; }
+
+
+// Server digests of the whole file: Digest / Repr-Digest (RFC 3230 / 9530), x-goog-hash,
+// Content-MD5 of a full 200 response, then an MD5-looking ETag; the fastest algorithm wins.
+void parse_digest_header(const std::string &line, long response_code, std::vector<Checksum> &found)
+{
+    std::size_t colon = line.find(':');
+    if( colon == std::string::npos ){ return; }
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    std::string value = line.substr(colon + 1);
+    value.erase(std::remove_if(value.begin(), value.end(), ::isspace), value.end());
+
+    if( name == "digest" || name == "repr-digest" || name == "x-goog-hash" ){
+        std::istringstream items(value);
+        std::string item ;
+        while( std::getline(items, item, ',') ){
+            std::size_t eq = item.find('=');
+            if( eq == std::string::npos ){ continue; }
+            std::string algorithm = item.substr(0, eq);
+            std::transform(algorithm.begin(), algorithm.end(), algorithm.begin(), ::tolower);
+            std::string encoded = item.substr(eq + 1);
+            encoded.erase(std::remove(encoded.begin(), encoded.end(), ':'), encoded.end());
+            if( algorithm == "sha-256" ){ algorithm = "sha256" ; }
+            if( algorithm != "sha256" && algorithm != "md5" && algorithm != "crc32c" ){ continue; }
+            std::string hex = base64_to_hex(encoded);
+            if( !hex.empty() ){ found.push_back(Checksum{algorithm, hex, line.substr(0, colon) + " header"}); }
+        }
+    }else if( name == "content-md5" && response_code == 200 ){
+        std::string hex = base64_to_hex(value);
+        if( hex.size() == 32 ){ found.push_back(Checksum{"md5", hex, "Content-MD5 header"}); }
+    }else if( name == "etag" ){
+        std::string tag = value ;
+        tag.erase(std::remove(tag.begin(), tag.end(), '"'), tag.end());
+        std::transform(tag.begin(), tag.end(), tag.begin(), ::tolower);
+        if( tag.size() == 32 && tag.find_first_not_of("0123456789abcdef") == std::string::npos ){
+            found.push_back(Checksum{"md5", tag, "ETag", true});
+        }
+    }
+}
+
+
+// The checksum to verify a file with: --checksum first, else the best one the server sent
+Checksum choose_checksum(const Checksum &requested, const std::vector<Checksum> &found)
+{
+    if( !requested.expected.empty() ){ return requested ; }
+    for(const char *algorithm : {"crc32c", "sha256", "md5"}){
+        if( !requested.algorithm.empty() && requested.algorithm != algorithm ){ continue; }
+        for(bool advisory : {false, true}){
+            for(const Checksum &c : found){
+                if( c.algorithm == algorithm && c.advisory == advisory ){ return c ; }
+            }
+        }
+    }
+
+return requested; }
+
+
+// Output file shared by all work units inside that part (whole output when writing directly)
+struct PartFile {
+    int fd ;
+    int users ;
+    bool created ;
+};
+
+
+// One URL serving a file, with its measured throughput
+struct Mirror {
+    std::string url ;
+    std::string host ;
+    bool enabled = true ;
+    int active = 0 ;
+    double rate = -1.0 ;       // Bytes/s per connection (moving average), -1 --> not measured yet
+    long long int received = 0 ;
+    double connect_ms = -1.0 ; // Fastest TCP connect seen, -1 --> none
+};
+
+
+// One remote file, its output layout and progress
+struct Job {
+    std::string url ;
+    std::vector<Mirror> mirrors ; // Same file at several URLs, url first
+    std::string output_filename ;
+    std::string host ;
+    long long int file_size ;  // -1 until learned from the first response
+    std::string etag ;         // Of the first response, other mirrors must match
+    bool range_supported ;
+    // Layout, -1 --> default until planned
+    int num_part ;
+    long long int chunk_size ;
+    long long int unit_size ;
+    bool direct_write ;
+    bool planned ;
+    bool journaled ;
+    bool dirty ;               // Progress not yet journaled
+    bool finished ;
+    bool failed ;
+    int num_transfer ;         // Queued or in flight
+    long long int received ;   // Bytes accepted from the network in this run
+    std::vector<PartFile> parts ;
+    // Streaming in byte order (-o -) through a ring buffer instead of files
+    bool stream ;
+    int stream_fd ;
+    long long int max_buffer ;
+    long long int emitted ;    // Bytes already written to stream_fd
+    std::vector<char> ring ;   // Bytes [emitted, emitted + ring.size()) at position % ring.size()
+    Sink *sink ;               // Not owned, NULL --> files or stream
+    // Whole-file digest computed while receiving
+    Checksum checksum ;
+    std::map<long long int, std::pair<long long int, uint32_t>> crcs ; // CRC-32C of received segments, start --> (length, crc)
+    long long int hashed ;     // SHA-256 / MD5 cover bytes [0, hashed)
+    Sha256 sha256 ;
+    Md5 md5 ;
+    double verify_s ;          // Spent in verify_checksum()
+    Journal journal ;
+    ByteMap done ;
+};
+
+
+// One work unit, in flight or queued, of the multi engine
+struct Transfer {
+    CURL *curl ;
+    Job *job ;
+    int part ;               // Part index
+    int mirror ;             // Index in job->mirrors, chosen when started
+    long long int start ;    // Inclusive range, 'end' shrinks when the tail is stolen
+    long long int end ;
+    long long int pos ;      // Next byte to be received
+    int attempt ;
+    std::chrono::steady_clock::time_point not_before ; // Backoff before retrying
+    int fd ;
+    long long int base ;     // File offset of byte 0 of the part in fd
+    bool truncated ;         // Received data beyond 'end' was discarded
+    bool paused ;            // First response of an unplanned job, waiting for the layout
+    bool throttled ;         // Streaming data beyond the reorder window, waiting for the consumer
+    bool limited ;           // Paused by the rate limit, waiting for tokens
+    bool granted ;           // Resumed by the rate limit, one write callback allowed in debt
+    RateLimit *limit ;       // NULL --> unlimited
+    bool bad_range ;         // Server did not honor the requested range
+    bool bad_mirror ;        // Mirror serves a different size or ETag
+    bool journaled ;         // First transfer of a resumed job starting in journaled bytes, dropped
+    uint32_t crc ;           // CRC-32C of bytes [start, pos)
+    // Parsed from the response headers
+    long response_code ;
+    std::string etag ;
+    std::vector<Checksum> digests ;
+    long long int range_start ;
+    long long int range_total ;
+    long long int content_length ;
+    std::chrono::steady_clock::time_point started ;
+    std::string range ;
+    char errbuf[CURL_ERROR_SIZE] ;
+    // Progress of the attempt, single threaded like the whole event loop
+    long long int xfer_now ; // Bytes received according to libcurl (CURLOPT_XFERINFOFUNCTION)
+    long long int xfer_mark ;// xfer_now at the previous progress report
+    double rate ;            // Bytes/s, smoothed over the reports
+};
+
+
+// Queued work units per host, first transfers of unplanned jobs then smallest files first,
+// handing out at most max_host_connection concurrent transfers per host.
+// Streamed files are queued in byte order and held back beyond their reorder window.
+// Units are queued under the host of the first URL, the mirror is picked when started.
+struct Scheduler {
+    typedef std::pair<std::pair<long long int, long long int>, Transfer*> Entry ;
+    struct Host {
+        int active = 0 ;
+        std::set<Entry> ready ;
+    };
+    std::map<std::string, Host> hosts ;
+    std::vector<Transfer*> waiting ;  // Backing off
+    int max_host_connection ;
+    long long int sequence = 0 ;
+    std::size_t num_ready = 0 ;
+
+    void push(Transfer *t){
+        if( t->not_before > std::chrono::steady_clock::now() ){
+            waiting.push_back(t);
+            return;
+        }
+        long long int priority = (t->job->planned) ? t->job->file_size : -1 ;
+        long long int order = (t->job->stream) ? t->start : sequence ;
+        ++sequence ;
+        hosts[t->job->host].ready.insert(Entry(std::make_pair(priority, order), t));
+        ++num_ready ;
+    }
+
+    // Highest priority unit of any host below its connection limit, NULL if none
+    Transfer* pop(){
+        const auto now = std::chrono::steady_clock::now();
+        for(std::size_t k=0 ; k<waiting.size() ; ){
+            if( waiting[k]->not_before <= now ){
+                Transfer *t = waiting[k] ;
+                waiting[k] = waiting.back();
+                waiting.pop_back();
+                push(t);
+            }else{
+                ++k ;
+            }
+        }
+        Host *best = NULL ;
+        int best_mirror = -1 ;
+        for(auto &h : hosts){
+            if( h.second.ready.empty() ){ continue; }
+            const Transfer *head = h.second.ready.begin()->second ;
+            if( head->job->stream && head->job->planned && head->start > head->job->emitted
+                && head->end >= head->job->emitted + static_cast<long long int>(head->job->ring.size()) ){ continue; }
+            int mirror = pick_mirror(*head->job) ;
+            if( mirror < 0 ){ continue; }
+            if( !best || *h.second.ready.begin() < *best->ready.begin() ){
+                best = &h.second ;
+                best_mirror = mirror ;
+            }
+        }
+        if( !best ){ return NULL ; }
+        Transfer *t = best->ready.begin()->second ;
+        best->ready.erase(best->ready.begin());
+        --num_ready ;
+        t->mirror = best_mirror ;
+    return t; }
+
+    // Enabled mirror below the host limit with the best throughput per connection,
+    // unmeasured mirrors first and fewer connections on ties, -1 if none
+    int pick_mirror(const Job &job){
+        int best = -1 ;
+        for(int m=0 ; m<static_cast<int>(job.mirrors.size()) ; ++m){
+            const Mirror &mirror = job.mirrors[m] ;
+            if( !mirror.enabled || hosts[mirror.host].active >= max_host_connection ){ continue; }
+            if( best >= 0 ){
+                const Mirror &other = job.mirrors[best] ;
+                double rate = (mirror.rate < 0) ? HUGE_VAL : mirror.rate ;
+                double other_rate = (other.rate < 0) ? HUGE_VAL : other.rate ;
+                if( rate < other_rate || (rate == other_rate && mirror.active >= other.active) ){ continue; }
+            }
+            best = m ;
+        }
+    return best; }
+
+    bool host_available(const Job &job){ return pick_mirror(job) >= 0 ; }
+    void started(Transfer *t){
+        Mirror &mirror = t->job->mirrors[t->mirror] ;
+        ++mirror.active ;
+        ++hosts[mirror.host].active ;
+    }
+    void stopped(Transfer *t){
+        Mirror &mirror = t->job->mirrors[t->mirror] ;
+        --mirror.active ;
+        --hosts[mirror.host].active ;
+    }
+    bool empty() const { return num_ready == 0 && waiting.empty() ; }
+
+    // Time until the earliest backoff ends, POLL_TIMEOUT_MS at most
+    int timeout_ms() const {
+        int timeout = POLL_TIMEOUT_MS ;
+        const auto now = std::chrono::steady_clock::now();
+        for(const Transfer *t : waiting){
+            long long int wait = std::chrono::duration_cast<std::chrono::milliseconds>(t->not_before - now).count();
+            timeout = std::clamp(static_cast<int>(std::min(wait, static_cast<long long int>(timeout))), 0, timeout);
+        }
+        return timeout ;
+    }
+
+    void drain(std::vector<Transfer*> &out){
+        for(auto &h : hosts){
+            for(const Entry &e : h.second.ready){ out.push_back(e.second); }
+            h.second.ready.clear();
+        }
+        out.insert(out.end(), waiting.begin(), waiting.end());
+        waiting.clear();
+        num_ready = 0 ;
+    }
+};
+
+
+// --auto: hill-climb the number of concurrent connections on measured throughput.
+// Slow start doubles the limit while each window is AUTO_MIN_GAIN faster than the last,
+// then probes one connection at a time; a step that does not pay off is undone and held
+// for AUTO_HOLD_WINDOWS windows, and a window with many failed attempts halves the limit.
+struct AutoTune {
+    bool enabled = false ;
+    int limit = 0 ;           // Current connection limit
+    int max_limit = 0 ;       // -nc
+    int previous_limit = 0 ;
+    double previous_rate = 0.0 ;
+    bool slow_start = true ;
+    int hold = 0 ;            // Windows left before probing upwards again
+    int best_limit = 0 ;
+    double best_rate = 0.0 ;
+    int failures = 0 ;        // Attempts of this window
+    int completions = 0 ;
+    long long int window_bytes = 0 ;
+    std::chrono::steady_clock::time_point window_start ;
+
+    // From a known good limit (a host profile) there is no slow start
+    void start(const int num_connection, const int initial){
+        max_limit = num_connection ;
+        limit = std::min((initial > 0) ? initial : AUTO_START_CONNECTIONS, max_limit) ;
+        slow_start = ( initial <= 0 ) ;
+        previous_limit = best_limit = limit ;
+        window_start = std::chrono::steady_clock::now();
+    }
+
+    // Close the window once it is long enough, true when the limit changed
+    bool update(const long long int total_bytes){
+        const auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - window_start).count();
+        if( elapsed*1E3 < AUTO_WINDOW_MS ){ return false ; }
+        double rate = (total_bytes - window_bytes)/elapsed ;
+        window_bytes = total_bytes ;
+        window_start = now ;
+        // Fewest connections within AUTO_MIN_GAIN of the best throughput
+        if( rate > best_rate*(1.0 + AUTO_MIN_GAIN) ){
+            best_rate = rate ;
+            best_limit = limit ;
+        }else if( limit < best_limit && rate >= best_rate*(1.0 - AUTO_MIN_GAIN) ){
+            best_rate = std::max(best_rate, rate) ;
+            best_limit = limit ;
+        }
+
+        const int old_limit = limit ;
+        if( failures > 0 && failures*AUTO_MAX_FAILURE_RATIO >= failures + completions ){
+            limit = std::max(1, limit/2) ;
+            slow_start = false ;
+            hold = AUTO_HOLD_WINDOWS ;
+        }else if( limit > previous_limit && rate < previous_rate*(1.0 + AUTO_MIN_GAIN) ){
+            // The last step up did not pay off
+            limit = previous_limit ;
+            slow_start = false ;
+            hold = AUTO_HOLD_WINDOWS ;
+        }else if( hold > 0 ){
+            --hold ;
+        }else if( limit < max_limit ){
+            limit = (slow_start) ? std::min(2*limit, max_limit) : limit + 1 ;
+        }
+        failures = 0 ;
+        completions = 0 ;
+        previous_limit = old_limit ;
+        previous_rate = rate ;
+        return limit != old_limit ;
+    }
+};
+
+
+// Settings learned for one host by --auto runs, the starting point of the next run
+struct HostProfile {
+    int connections = 0 ;          // Connection count with the best throughput, 0 --> unknown
+    long long int unit_size = 0 ;  // Work unit lasting about UNIT_TARGET_S on one connection
+    bool range_supported = true ;
+    double rtt_ms = 0.0 ;          // TCP connect time
+    double rate = 0.0 ;            // Bytes/s reached with 'connections'
+    long long int updated = 0 ;    // Unix time
+};
+
+
+// $XDG_CACHE_HOME/co-curl/hosts, else ~/.cache/co-curl/hosts, empty if neither is set
+std::string profile_filename()
+{
+    const char *cache = std::getenv("XDG_CACHE_HOME");
+    if( cache && *cache ){ return std::string(cache) + "/co-curl/hosts" ; }
+    const char *home = std::getenv("HOME");
+    if( home && *home ){ return std::string(home) + "/.cache/co-curl/hosts" ; }
+return ""; }
+
+
+// "<host> <connections> <unit_size> <range> <rtt_ms> <bytes/s> <unix time>" per line, stale entries dropped
+void load_profiles(const std::string &filename, std::map<std::string, HostProfile> &profiles)
+{
+    std::ifstream file(filename.c_str());
+    std::string line ;
+    const long long int now = std::time(NULL) ;
+    while( std::getline(file, line) ){
+        std::istringstream fields(line);
+        std::string host ;
+        HostProfile profile ;
+        if( !(fields >> host) || host[0] == '#' ){ continue; }
+        if( !(fields >> profile.connections >> profile.unit_size >> profile.range_supported >> profile.rtt_ms >> profile.rate >> profile.updated) ){ continue; }
+        if( now - profile.updated > PROFILE_MAX_AGE_DAYS*86400LL ){ continue; }
+        profiles[host] = profile ;
+    }
+}
+
+
+// Merge into the file on disk (other runs may have added hosts) and replace it atomically
+bool save_profiles(const std::string &filename, const std::map<std::string, HostProfile> &updates)
+{
+    std::map<std::string, HostProfile> profiles ;
+    load_profiles(filename, profiles);
+    for(const auto &p : updates){ profiles[p.first] = p.second ; }
+
+    std::error_code error ;
+    fs::create_directories(fs::path(filename).parent_path(), error);
+    std::string tmp_filename = filename + ".tmp" + std::to_string(getpid()) ;
+    FILE *fp = fopen(tmp_filename.c_str(), "w");
+    if( fp==NULL ){ return false ; }
+
+    std::fputs("# co-curl host profiles: <host> <connections> <unit_size> <range> <rtt_ms> <bytes/s> <unix time>\n", fp);
+    for(const auto &p : profiles){
+        const HostProfile &h = p.second ;
+        std::fprintf(fp, "%s %d %lld %d %.1f %.0f %lld\n", p.first.c_str(), h.connections, h.unit_size, h.range_supported ? 1 : 0, h.rtt_ms, h.rate, h.updated);
+    }
+    bool success = ( std::fclose(fp) == 0 ) ;
+    if( success ){ success = ( std::rename(tmp_filename.c_str(), filename.c_str()) == 0 ) ; }
+    if( !success ){ std::remove(tmp_filename.c_str()); }
+
+return success; }
+
+
+// host:port of url, used to apply the per-host connection limit
+std::string url_host(const std::string &url)
+{
+    std::string host = url ;
+    CURLU *handle = curl_url();
+    char *part ;
+    if( handle && curl_url_set(handle, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK ){
+        if( curl_url_get(handle, CURLUPART_HOST, &part, 0) == CURLUE_OK ){
+            host = part ;
+            curl_free(part);
+            if( curl_url_get(handle, CURLUPART_PORT, &part, CURLU_DEFAULT_PORT) == CURLUE_OK ){
+                host += std::string(":") + part ;
+                curl_free(part);
+            }
+        }
+    }
+    if( handle ){ curl_url_cleanup(handle); }
+
+return host; }
+
+
+// Split file_size into num_part parts of chunk_size bytes and work units of unit_size bytes
+// -1 --> default, --num-part and --chunk-size are mutually exclusive
+void plan_layout(const long long int file_size, const int num_connection, int &num_part, long long int &chunk_size, long long int &unit_size)
+{
+    if( chunk_size < 0 ){
+        if( num_part < 0 ){ num_part = num_connection ; }
+        num_part = static_cast<int>(std::min(static_cast<long long int>(num_part), file_size));
+        chunk_size = file_size/num_part ;
+    }else{
+        num_part = (file_size - 1)/chunk_size + 1 ;
+    }
+    // Block aligned parts for the merge's FICLONERANGE, unless the last part would be empty
+    const long long int aligned = (chunk_size + PART_ALIGNMENT - 1)/PART_ALIGNMENT*PART_ALIGNMENT ;
+    if( (num_part - 1)*aligned < file_size ){ chunk_size = aligned ; }
+    if( unit_size < 0 ){
+        unit_size = std::max(file_size/(static_cast<long long int>(num_connection)*DEFAULT_UNITS_PER_CONNECTION), static_cast<long long int>(MIN_UNIT_SIZE));
+    }
+    unit_size = std::min(unit_size, chunk_size);
+}
+
+
+// Record status, Content-Range, Content-Length, ETag and digests of the final response (after redirects)
+size_t curl_header_unit(char *buffer, size_t size, size_t nitems, Transfer *t){
+    const size_t length = size*nitems ;
+    std::string line(buffer, length);
+    if( line.compare(0, 5, "HTTP/") == 0 ){
+        std::size_t pos = line.find(' ');
+        t->response_code = (pos != std::string::npos) ? std::atol(line.c_str() + pos + 1) : 0 ;
+        t->range_start = -1 ;
+        t->range_total = -1 ;
+        t->content_length = -1 ;
+        t->etag.clear();
+        t->digests.clear();
+    }else if( strncasecmp(line.c_str(), "content-range:", 14) == 0 ){
+        long long int first, last, total ;
+        if( std::sscanf(line.c_str() + 14, " bytes %lld-%lld/%lld", &first, &last, &total) == 3 ){
+            t->range_start = first ;
+            t->range_total = total ;
+        }
+    }else if( strncasecmp(line.c_str(), "content-length:", 15) == 0 ){
+        t->content_length = std::atoll(line.c_str() + 15);
+    }else if( strncasecmp(line.c_str(), "etag:", 5) == 0 ){
+        t->etag = line.substr(5);
+        t->etag.erase(std::remove_if(t->etag.begin(), t->etag.end(), ::isspace), t->etag.end());
+    }
+    if( !t->job->planned ){
+        parse_digest_header(line, t->response_code, t->digests);
+    }
+    return length ;
+}
+
+
+// Part filename, or output filename when writing directly or streaming
+std::string target_filename(const Job &job, const int part)
+{
+    if( job.direct_write || job.stream ){ return job.output_filename ; }
+return job.output_filename + ".part" + std::to_string(part); }
+
+
+void digest_update(Job &job, const char *data, std::size_t length)
+{
+    if( job.checksum.algorithm == "sha256" ){ job.sha256.update(data, length); }
+    else if( job.checksum.algorithm == "md5" ){ job.md5.update(data, length); }
+    job.hashed += length ;
+}
+
+
+// Fold bytes just received at t->pos into the digest: CRC-32C per transfer in any order,
+// sequential digests only when they extend the hashed prefix (the rest is caught up later)
+void digest_received(Transfer *t, const char *data, std::size_t length)
+{
+    Job &job = *t->job ;
+    if( job.checksum.algorithm == "crc32c" ){
+        t->crc = crc32c(t->crc, data, length);
+    }else if( !job.checksum.algorithm.empty() && t->pos == job.hashed ){
+        digest_update(job, data, length);
+    }
+}
+
+
+// Bytes [t->start, last] are final: mark them done and keep their CRC-32C for combining
+void record_received(Job &job, Transfer *t, const long long int last)
+{
+    job.done.add(t->start, last);
+    if( job.checksum.algorithm == "crc32c" ){
+        job.crcs[t->start] = std::make_pair(last - t->start + 1, t->crc);
+    }
+    t->crc = 0 ;
+}
+
+
+int curl_xferinfo_unit(void *clientp, curl_off_t, curl_off_t dlnow, curl_off_t, curl_off_t){
+    static_cast<Transfer*>(clientp)->xfer_now = dlnow ;
+    return 0 ;
+}
+
+
+// Positional write capped at t->end, returning short aborts the transfer
+size_t curl_write_unit(void *ptr, size_t size, size_t nmemb, Transfer *t){
+    if( t->job->failed || t->journaled ){ return 0 ; }
+    if( !t->job->planned ){
+        t->paused = true ;
+        return CURL_WRITEFUNC_PAUSE ;
+    }
+    if( t->pos == t->start ){
+        if( (t->response_code == 200 && t->start > 0) || (t->response_code == 206 && t->range_start != t->start) ){
+            t->bad_range = true ;
+            return 0 ;
+        }
+        const Job &job = *t->job ;
+        long long int size = (t->response_code == 206) ? t->range_total : t->content_length ;
+        bool strong = ( !t->etag.empty() && !job.etag.empty() && t->etag[0] == '"' && job.etag[0] == '"' ) ;
+        if( job.mirrors.size() > 1 && ((size > 0 && size != job.file_size) || (strong && t->etag != job.etag)) ){
+            t->bad_mirror = true ;
+            return 0 ;
+        }
+    }
+
+    if( t->limit && !t->granted && !t->limit->allow() ){
+        t->limited = true ;
+        return CURL_WRITEFUNC_PAUSE ;
+    }
+
+    const char *data = static_cast<const char*>(ptr);
+    size_t total = size*nmemb ;
+    size_t remain = total ;
+    const long long int before = t->pos ;
+    if( t->pos + static_cast<long long int>(remain) > t->end + 1 ){
+        remain = (t->pos > t->end) ? 0 : t->end + 1 - t->pos ;
+        t->truncated = true ;
+    }
+    if( t->job->stream ){
+        std::vector<char> &ring = t->job->ring ;
+        const long long int capacity = ring.size() ;
+        if( t->pos + static_cast<long long int>(remain) > t->job->emitted + capacity ){
+            t->truncated = false ;
+            t->throttled = true ;
+            return CURL_WRITEFUNC_PAUSE ;
+        }
+        std::size_t index = t->pos % capacity ;
+        std::size_t first = std::min(remain, ring.size() - index) ;
+        std::memcpy(ring.data() + index, data, first);
+        std::memcpy(ring.data(), data + first, remain - first);
+        digest_received(t, data, remain);
+        t->job->received += remain ;
+        t->pos += remain ;
+        remain = 0 ;
+    }else if( t->job->sink && remain > 0 ){
+        if( !t->job->sink->write(t->pos, data, remain) ){ return 0 ; }
+        digest_received(t, data, remain);
+        t->job->received += remain ;
+        t->pos += remain ;
+        remain = 0 ;
+    }
+    while( remain > 0 ){
+        ssize_t written = pwrite(t->fd, data, remain, t->base + t->pos);
+        if( written < 0 ){
+            if( errno == EINTR ){ continue; }
+            return 0 ;
+        }
+        digest_received(t, data, written);
+        t->job->received += written ;
+        data += written ;
+        remain -= written ;
+        t->pos += written ;
+    }
+    if( t->limit ){
+        t->limit->spend(t->pos - before);
+        t->granted = false ;
+    }
+    return (t->truncated) ? 0 : total ;
+}
+
+
+// First byte from 'from' on that has not been received yet
+long long int contiguous_end(const Job &job, const std::vector<Transfer*> &active, const long long int from)
+{
+    long long int available = from ;
+    bool advanced = true ;
+    while( advanced ){
+        advanced = false ;
+        for(const auto &r : job.done.ranges){
+            if( r.first <= available && available <= r.second ){
+                available = r.second + 1 ;
+                advanced = true ;
+            }
+        }
+        for(const Transfer *t : active){
+            if( t->job == &job && t->start <= available && available < t->pos ){
+                available = t->pos ;
+                advanced = true ;
+            }
+        }
+    }
+
+return available; }
+
+
+// Copy received bytes [start, start+length) back from the ring, the sink or the output files
+bool read_back(const Job &job, long long int start, long long int length, char *buffer)
+{
+    if( job.sink ){
+        if( job.sink->read(start, buffer, length) ){ return true ; }
+        std::cerr << "CO-CURL::ERROR -- Cannot read back '" << job.output_filename << "' from its sink to verify the " << job.checksum.algorithm << "." << std::endl;
+        return false ;
+    }
+    if( job.stream ){
+        const long long int capacity = job.ring.size() ;
+        for(long long int i=0 ; i<length ; ++i){ buffer[i] = job.ring[(start + i) % capacity] ; }
+        return true ;
+    }
+    while( length > 0 ){
+        int index = (job.direct_write) ? 0 : static_cast<int>(start/job.chunk_size) ;
+        long long int offset = (job.direct_write) ? start : start - index*job.chunk_size ;
+        long long int count = (job.direct_write) ? length : std::min(length, job.chunk_size - offset) ;
+        std::string filename = target_filename(job, index) ;
+        int fd = open(filename.c_str(), O_RDONLY);
+        if( fd < 0 ){
+            std::cerr << "CO-CURL::ERROR -- Cannot read back '" << filename << "' --> " << std::strerror(errno) << std::endl;
+            return false ;
+        }
+        while( count > 0 ){
+            ssize_t got = pread(fd, buffer, count, offset);
+            if( got < 0 && errno == EINTR ){ continue; }
+            if( got <= 0 ){
+                std::cerr << "CO-CURL::ERROR -- Cannot read back '" << filename << "'." << std::endl;
+                close(fd);
+                return false ;
+            }
+            buffer += got ;
+            start += got ;
+            offset += got ;
+            length -= got ;
+            count -= got ;
+        }
+        close(fd);
+    }
+
+return true; }
+
+
+// Bring a sequential digest up to the received prefix, re-reading only bytes that arrived out of order
+bool advance_digest(Job &job, const std::vector<Transfer*> &active)
+{
+    if( job.checksum.algorithm != "sha256" && job.checksum.algorithm != "md5" ){ return true ; }
+    const long long int available = contiguous_end(job, active, job.hashed) ;
+    std::vector<char> buffer ;
+    while( job.hashed < available ){
+        long long int length = std::min(available - job.hashed, static_cast<long long int>(READ_BACK_SIZE));
+        buffer.resize(length);
+        if( !read_back(job, job.hashed, length, buffer.data()) ){ return false ; }
+        digest_update(job, buffer.data(), length);
+    }
+
+return true; }
+
+
+// Finish the digest of a completed file and compare it, true unless a required one mismatches
+bool verify_checksum(Job &job, const std::vector<Transfer*> &active, bool verbose)
+{
+    if( job.checksum.algorithm.empty() ){ return true ; }
+
+    std::string actual ;
+    if( job.checksum.algorithm == "crc32c" ){
+        // Combine segment CRCs in order, ranges resumed from a previous run are read back
+        uint32_t crc = 0 ;
+        long long int pos = 0 ;
+        std::vector<char> buffer ;
+        while( pos < job.file_size ){
+            auto it = job.crcs.lower_bound(pos);
+            if( it != job.crcs.end() && it->first == pos ){
+                crc = crc32c_combine(crc, it->second.second, it->second.first);
+                pos += it->second.first ;
+                continue;
+            }
+            long long int gap_end = (it != job.crcs.end()) ? it->first : job.file_size ;
+            long long int length = std::min(gap_end - pos, static_cast<long long int>(READ_BACK_SIZE));
+            buffer.resize(length);
+            if( !read_back(job, pos, length, buffer.data()) ){ return false ; }
+            crc = crc32c(crc, buffer.data(), length);
+            pos += length ;
+        }
+        char hex[9] ;
+        std::snprintf(hex, sizeof(hex), "%08x", crc);
+        actual = hex ;
+    }else{
+        if( !advance_digest(job, active) ){ return false ; }
+        actual = to_hex((job.checksum.algorithm == "sha256") ? job.sha256.final() : job.md5.final());
+    }
+
+    if( job.checksum.expected.empty() ){
+        std::cout << "CO-CURL:: " << job.checksum.algorithm << " " << actual << "  " << job.output_filename << std::endl;
+        return true ;
+    }
+    if( actual == job.checksum.expected ){
+        if( verbose ){ std::cout << "--> Verified " << job.checksum.algorithm << " of '" << job.output_filename << "' against " << job.checksum.source << "." << std::endl; }
+        return true ;
+    }
+    std::cerr << "CO-CURL::" << ((job.checksum.advisory) ? "WARNING" : "ERROR") << " -- " << job.checksum.algorithm
+    << " of '" << job.output_filename << "' is " << actual << ", expected " << job.checksum.expected
+    << " (" << job.checksum.source << ")." << std::endl;
+
+return job.checksum.advisory; }
+
+
+// Write every byte received in order so far to the stream, true unless the consumer is gone
+bool flush_stream(Job &job, const std::vector<Transfer*> &active)
+{
+    if( !advance_digest(job, active) ){ return false ; }
+    const long long int available = contiguous_end(job, active, job.emitted) ;
+    const long long int capacity = job.ring.size() ;
+    while( job.emitted < available ){
+        std::size_t index = job.emitted % capacity ;
+        std::size_t length = std::min(available - job.emitted, capacity - static_cast<long long int>(index));
+        ssize_t written = write(job.stream_fd, job.ring.data() + index, length);
+        if( written < 0 ){
+            if( errno == EINTR ){ continue; }
+            std::cerr << "CO-CURL::ERROR -- Cannot write to the output stream --> " << std::strerror(errno) << std::endl;
+            return false ;
+        }
+        job.emitted += written ;
+    }
+
+return true; }
+
+
+Transfer* new_transfer(Job &job, const int part, const long long int start, const long long int end)
+{
+    Transfer *t = new Transfer ;
+    t->curl = NULL ;
+    t->job = &job ;
+    t->part = part ;
+    t->start = start ;
+    t->end = end ;
+    t->attempt = 0 ;
+    t->not_before = std::chrono::steady_clock::time_point();
+    t->fd = -1 ;
+    t->crc = 0 ;
+    ++job.num_transfer ;
+
+return t; }
+
+
+// Forget a transfer, true when it was the last one of its job
+bool release_transfer(Transfer *t)
+{
+    Job &job = *t->job ;
+    if( t->curl ){ curl_easy_cleanup(t->curl); }
+    delete t ;
+
+return --job.num_transfer == 0 ; }
+
+
+// Split the remaining range of the slowest in-flight transfer at its current write offset
+Transfer* steal_work(const std::vector<Transfer*> &active, Scheduler &scheduler)
+{
+    const auto now = std::chrono::steady_clock::now();
+    Transfer *victim = NULL ;
+    double victim_eta = 0.0 ;
+    for(Transfer *t : active){
+        if( !t->job->planned || t->job->failed || t->throttled || !t->job->range_supported || !scheduler.host_available(*t->job) ){ continue; }
+        long long int remain = t->end - t->pos + 1 ;
+        if( remain < 2*std::min(t->job->unit_size, static_cast<long long int>(MIN_UNIT_SIZE)) ){ continue; }
+        double elapsed = std::chrono::duration<double>(now - t->started).count();
+        double rate = (t->pos - t->start + 1.0)/std::max(elapsed, 1E-3);
+        double eta = remain/rate ;
+        if( eta > victim_eta ){
+            victim = t ;
+            victim_eta = eta ;
+        }
+    }
+    if( !victim ){ return NULL ; }
+
+    Transfer *t = new_transfer(*victim->job, victim->part, victim->pos + (victim->end - victim->pos + 1)/2, victim->end);
+    victim->end = t->start - 1 ;
+
+return t; }
+
+
+// Open the destination file of a transfer on demand, nothing to open before the job is planned
+bool open_target(Job &job, Transfer *t)
+{
+    t->fd = -1 ;
+    if( !job.planned || job.stream || job.sink ){ return true ; }
+
+    int index = (job.direct_write) ? 0 : t->part ;
+    PartFile &part = job.parts[index] ;
+    if( part.fd < 0 ){
+        std::string part_filename = target_filename(job, index) ;
+        part.fd = open(part_filename.c_str(), O_WRONLY | O_CREAT | ((part.created) ? 0 : O_TRUNC), 0644);
+        if( part.fd < 0 ){
+            std::printf("CO-CURL::ERROR -- Cannot create '%s'\n --> %s\n", part_filename.c_str(), std::strerror(errno));
+            return false ;
+        }
+        part.created = true ;
+    }
+    ++part.users ;
+    t->fd = part.fd ;
+    t->base = (job.direct_write) ? 0 : -t->part*job.chunk_size ;
+
+return true; }
+
+
+void close_target(Job &job, Transfer *t)
+{
+    if( t->fd < 0 ){ return; }
+    PartFile &part = job.parts[(job.direct_write) ? 0 : t->part] ;
+    if( --part.users == 0 ){
+        if( job.journaled ){ fdatasync(part.fd); }
+        close(part.fd);
+        part.fd = -1 ;
+    }
+    t->fd = -1 ;
+}
+
+
+// Make received data durable then record it, including partial progress of in-flight units
+bool sync_journal(Job &job, const std::vector<Transfer*> &active)
+{
+    for(const PartFile &part : job.parts){
+        if( part.fd >= 0 && fdatasync(part.fd) != 0 ){ return false ; }
+    }
+    job.journal.done = job.done ;
+    for(const Transfer *t : active){
+        if( t->job == &job && t->pos > t->start ){ job.journal.done.add(t->start, t->pos - 1); }
+    }
+    job.dirty = false ;
+
+return journal_save(job.journal); }
+
+
+// Once the file size is known: fix the layout, create the output, load the journal
+// and queue every range neither done in a previous run nor covered by the first transfer.
+bool plan_job(Job &job, const int num_connection, Transfer *first, Scheduler &scheduler, bool verbose)
+{
+    if( job.stream ){
+        // One part, units small enough to keep every connection busy inside the window
+        job.num_part = 1 ;
+        job.chunk_size = job.file_size ;
+        job.ring.assign(std::max(std::min(job.max_buffer, job.file_size), 1LL), 0);
+        job.emitted = 0 ;
+        if( job.unit_size < 0 ){
+            job.unit_size = std::max(job.file_size/(static_cast<long long int>(num_connection)*DEFAULT_UNITS_PER_CONNECTION), static_cast<long long int>(MIN_UNIT_SIZE));
+        }
+        job.unit_size = std::max(std::min(job.unit_size, job.max_buffer/num_connection), static_cast<long long int>(CURL_MAX_WRITE_SIZE));
+        job.unit_size = std::min(job.unit_size, job.file_size);
+        job.journaled = false ;
+        if( !job.range_supported ){
+            std::cerr << "CO-CURL::WARNING -- Server does not support ranged requests, streaming '" << job.url << "' with a single connection." << std::endl;
+        }
+    }else if( job.sink ){
+        // One part without a file, units as usual
+        job.num_part = -1 ;
+        job.chunk_size = -1 ;
+        plan_layout(job.file_size, num_connection, job.num_part, job.chunk_size, job.unit_size);
+        job.direct_write = true ;
+        job.num_part = 1 ;
+        job.chunk_size = job.file_size ;
+        job.unit_size = (job.range_supported) ? job.unit_size : job.file_size ;
+        job.journaled = false ;
+        if( !job.range_supported ){
+            std::cerr << "CO-CURL::WARNING -- Server does not support ranged requests, downloading '" << job.output_filename << "' with a single connection." << std::endl;
+        }
+        if( !job.sink->open(job.file_size) ){
+            std::cerr << "CO-CURL::ERROR -- The sink of '" << job.output_filename << "' refused " << job.file_size << " bytes." << std::endl;
+            return false ;
+        }
+    }else if( job.file_size < MIN_FILE_SIZE_FOR_PARALLEL || !job.range_supported ){
+        if( !job.range_supported ){
+            std::cerr << "CO-CURL::WARNING -- Server does not support ranged requests, downloading '" << job.output_filename << "' with a single connection." << std::endl;
+        }
+        job.direct_write = true ;
+        job.num_part = 1 ;
+        job.chunk_size = job.file_size ;
+        job.unit_size = job.file_size ;
+        job.journaled = false ;
+    }else{
+        plan_layout(job.file_size, num_connection, job.num_part, job.chunk_size, job.unit_size);
+        job.journaled = true ;
+    }
+
+    job.done.ranges.clear();
+    if( job.stream || job.sink ){
+        // Nothing to create
+    }else if( job.journaled ){
+        job.journal.filename = job.output_filename + ".journal" ;
+        job.journal.header = journal_header(job.url, job.file_size, job.num_part, job.chunk_size, job.direct_write);
+        if( journal_load(job.journal) ){
+            job.done = job.journal.done ;
+            if( verbose && !job.done.ranges.empty() ){
+                std::printf("CO-CURL:: Resuming from '%s', %lld of %lld bytes already downloaded.\n", job.journal.filename.c_str(), job.done.covered(), job.file_size);
+            }
+        }
+    }
+
+    if( job.stream || job.sink ){
+        job.parts.clear();
+    }else if( job.direct_write ){
+        if( verbose ){ std::cout << "--> Preallocating '" << job.output_filename << "'." << std::endl; }
+        int fd = open(job.output_filename.c_str(), O_WRONLY | O_CREAT | ((job.done.ranges.empty()) ? O_TRUNC : 0), 0644);
+        if( fd < 0 || !preallocate_file(fd, job.file_size) ){
+            std::cerr << "CO-CURL::ERROR -- Cannot preallocate '" << job.output_filename << "' (" << std::strerror(errno) << ")." << std::endl;
+            if( fd >= 0 ){ close(fd); }
+            return false ;
+        }
+        close(fd);
+        job.parts.assign(1, PartFile{-1, 0, true});
+    }else{
+        job.parts.assign(job.num_part, PartFile{-1, 0, !job.done.ranges.empty()});
+    }
+
+    // The first transfer keeps whatever fits in part 0 (in the first unit when streaming)
+    // up to the journaled bytes, and is dropped when resuming inside them
+    first->end = (job.range_supported) ? std::min(first->end, std::min(job.chunk_size, job.file_size) - 1) : job.file_size - 1 ;
+    if( job.stream && job.range_supported ){ first->end = std::min(first->end, job.unit_size - 1) ; }
+    for(const auto &r : job.done.ranges){
+        if( r.first <= first->start && first->start <= r.second ){ first->journaled = true ; break; }
+        if( r.first > first->start ){ first->end = std::min(first->end, r.first - 1) ; break; }
+    }
+    ByteMap claimed = job.done ;
+    if( !first->journaled ){ claimed.add(first->start, first->end); }
+    job.checksum = choose_checksum(job.checksum, first->digests);
+    job.planned = true ;
+
+    for(int i=0 ; i<job.num_part ; ++i){
+        long long int part_start = i*job.chunk_size ;
+        long long int part_end = (i==job.num_part-1)  ?  job.file_size - 1 : part_start + job.chunk_size - 1 ;
+        for(long long int start=part_start ; start<=part_end ; start+=job.unit_size){
+            long long int end = std::min(start + job.unit_size - 1, part_end) ;
+            // Subtract claimed ranges
+            long long int next = start ;
+            while( next <= end ){
+                long long int gap_end = end ;
+                bool skip = false ;
+                for(const auto &r : claimed.ranges){
+                    if( r.first <= next && next <= r.second ){ next = r.second + 1 ; skip = true ; break; }
+                    if( r.first > next ){ gap_end = std::min(end, r.first - 1) ; break; }
+                }
+                if( skip ){ continue; }
+                scheduler.push(new_transfer(job, i, next, gap_end));
+                next = gap_end + 1 ;
+            }
+        }
+    }
+
+    if( verbose ){
+        std::cout << "\n"
+        << " Download: " << job.url << "\n"
+        << " Output: " << job.output_filename << " (" << job.file_size/1E6 << " MB)\n"
+        << " By splitting into " << job.num_part << " parts, each about " << job.chunk_size/1E6 << " MB.\n"
+        << " which will be downloaded concurrently using up to " << num_connection << " connections\n"
+        << " in work units of about " << job.unit_size/1E6 << " MB.\n"
+        << ((job.sink) ? " Writing into a sink.\n" : (job.direct_write) ? " Writing directly into the preallocated output (no merge).\n" : "")
+        << ((job.stream) ? " Streaming in byte order through a " + std::to_string(job.ring.size()/1000000) + " MB reorder buffer.\n" : "")
+        << ((job.checksum.expected.empty()) ? "" : " Verifying " + job.checksum.algorithm + " from " + job.checksum.source + ".\n")
+        << std::endl;
+    }
+
+return true; }
+
+
+// Fold the throughput of a finished attempt into its mirror's moving average
+void measure_mirror(Mirror &mirror, const Transfer *t)
+{
+    long long int received = t->pos - t->start ;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t->started).count();
+    if( received <= 0 || elapsed <= 0.0 ){ return; }
+    double rate = received/elapsed ;
+    mirror.rate = (mirror.rate < 0) ? rate : (1.0 - MIRROR_RATE_WEIGHT)*mirror.rate + MIRROR_RATE_WEIGHT*rate ;
+    mirror.received += received ;
+}
+
+
+// Stop using a mirror unless it is the last one left, true when another mirror remains
+bool disable_mirror(Job &job, const int m)
+{
+    if( !job.mirrors[m].enabled ){ return true ; }
+    int num_enabled = 0 ;
+    for(const Mirror &mirror : job.mirrors){ num_enabled += mirror.enabled ; }
+    if( num_enabled < 2 ){ return false ; }
+    job.mirrors[m].enabled = false ;
+    std::printf("CO-CURL::WARNING -- No longer using '%s' for '%s'.\n", job.mirrors[m].url.c_str(), job.output_filename.c_str());
+
+return true; }
+
+
+// Whole file received, or given up: release files and the journal
+void finish_job(Job &job, const std::vector<Transfer*> &active, bool verbose)
+{
+    job.finished = true ;
+    if( job.planned && !job.failed && job.done.covered() == job.file_size && (!job.stream || job.emitted == job.file_size) ){
+        if( job.journaled ){ std::remove(job.journal.filename.c_str()); }
+        const auto verify_begin = std::chrono::steady_clock::now() ;
+        const bool verified = verify_checksum(job, active, verbose) ;
+        job.verify_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - verify_begin).count() ;
+        if( !verified ){
+            job.failed = true ;
+            if( job.sink ){ job.sink->close(false); }
+            return;
+        }
+        if( job.sink ){ job.sink->close(true); }
+        if( verbose ){
+            std::cout << "--> Finish downloading '" << job.output_filename << "'." << std::endl;
+            for(const Mirror &mirror : job.mirrors){
+                if( job.mirrors.size() < 2 ){ break; }
+                std::cout << "--> " << mirror.received/1E6 << " MB from '" << mirror.url << "' at "
+                << std::max(mirror.rate, 0.0)/1E6 << " MB/s per connection." << std::endl;
+            }
+        }
+        return;
+    }
+
+    job.failed = true ;
+    if( job.planned && job.sink ){ job.sink->close(false); }
+    if( job.planned ){
+        std::cerr << "CO-CURL::ERROR -- Downloaded " << job.done.covered() << " of " << job.file_size << " bytes of '" << job.output_filename << "'." << std::endl;
+        if( job.journaled && sync_journal(job, active) ){
+            std::cerr << "CO-CURL:: Progress saved in '" << job.journal.filename << "', rerun the same command to resume." << std::endl;
+        }
+    }
+}
+
+
+// Phases of a finished transfer, libcurl reports them cumulated from its start
+void measure_timing(CURL *curl, TransferTiming &timing)
+{
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, starttransfer = 0, total = 0 ;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    const curl_off_t handshake = std::max(std::max(namelookup, connect), appconnect) ;
+    const curl_off_t first_byte = (starttransfer > 0) ? starttransfer : total ; // None received
+    timing.dns_s = namelookup/1E6 ;
+    timing.connect_s = (connect > 0) ? std::max(connect - namelookup, curl_off_t(0))/1E6 : 0.0 ;
+    timing.tls_s = (appconnect > 0) ? std::max(appconnect - connect, curl_off_t(0))/1E6 : 0.0 ;
+    timing.wait_s = std::max(first_byte - handshake, curl_off_t(0))/1E6 ;
+    timing.transfer_s = std::max(total - first_byte, curl_off_t(0))/1E6 ;
+    timing.total_s = total/1E6 ;
+}
+
+
+// Totals between two progress reports
+struct ProgressMeter {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now() ;
+    std::chrono::steady_clock::time_point last = begin ;
+    long long int last_received = 0 ;
+    double rate = 0.0 ;      // Smoothed, for the ETA
+};
+
+
+// Aggregate of all jobs and in-flight transfers, stragglers against the median connection rate
+Progress measure_progress(const std::vector<Job> &jobs, const std::vector<Transfer*> &active, const std::size_t num_finished, ProgressMeter &meter)
+{
+    const auto now = std::chrono::steady_clock::now() ;
+    const double interval = std::chrono::duration<double>(now - meter.last).count() ;
+    Progress progress ;
+    progress.received = 0 ;
+    progress.total = 0 ;
+    progress.num_finished = num_finished ;
+    progress.num_files = jobs.size() ;
+    progress.elapsed_s = std::chrono::duration<double>(now - meter.begin).count() ;
+    progress.num_stragglers = 0 ;
+
+    long long int remaining = 0 ;
+    bool sizes_known = true ;
+    for(const Job &job : jobs){
+        progress.received += job.received ;
+        if( job.planned ){ progress.total += job.file_size ; }
+        if( job.finished || job.failed ){ continue; }
+        if( job.planned ){ remaining += job.file_size - job.done.covered() ; }
+        else{ sizes_known = false ; }
+    }
+
+    std::vector<double> rates ;
+    for(Transfer *t : active){
+        if( t->job->planned && !t->job->finished ){ remaining -= t->pos - t->start ; }
+        if( interval > 0.0 ){
+            const double rate = (t->xfer_now - t->xfer_mark)/interval ;
+            t->rate = (t->xfer_mark == 0) ? rate : PROGRESS_RATE_WEIGHT*rate + (1.0 - PROGRESS_RATE_WEIGHT)*t->rate ;
+            t->xfer_mark = t->xfer_now ;
+        }
+        if( now - t->started >= std::chrono::milliseconds(STRAGGLER_MIN_AGE_MS) && !t->throttled ){ rates.push_back(t->rate); }
+    }
+    double median = 0.0 ;
+    if( rates.size() >= 2 ){
+        std::nth_element(rates.begin(), rates.begin() + rates.size()/2, rates.end());
+        median = rates[rates.size()/2] ;
+    }
+    for(const Transfer *t : active){
+        ConnectionProgress c ;
+        c.file = t->job - jobs.data() ;
+        c.host = t->job->mirrors[t->mirror].host ;
+        c.start = t->start ;
+        c.end = t->end ;
+        c.received = t->xfer_now ;
+        c.rate = t->rate ;
+        c.straggler = ( median > 0.0 && now - t->started >= std::chrono::milliseconds(STRAGGLER_MIN_AGE_MS) && !t->throttled && t->rate < STRAGGLER_RATIO*median ) ;
+        progress.num_stragglers += c.straggler ;
+        progress.connections.push_back(c);
+    }
+
+    if( interval > 0.0 ){
+        const double rate = (progress.received - meter.last_received)/interval ;
+        meter.rate = (meter.last_received == 0) ? rate : PROGRESS_RATE_WEIGHT*rate + (1.0 - PROGRESS_RATE_WEIGHT)*meter.rate ;
+        progress.rate = rate ;
+        meter.last = now ;
+        meter.last_received = progress.received ;
+    }else{
+        progress.rate = meter.rate ;
+    }
+    progress.average_rate = (progress.elapsed_s > 0.0) ? progress.received/progress.elapsed_s : 0.0 ;
+    progress.eta_s = (!sizes_known) ? -1.0 : (remaining <= 0) ? 0.0 : (meter.rate > 0.0) ? remaining/meter.rate : -1.0 ;
+
+return progress; }
+
+
+// Download whole files through one curl_multi event loop with at most num_connection
+// concurrent transfers in total and max_host_connection per host.
+// No separate size request: the first ranged GET of each file reveals the size
+// (Content-Range), then the remaining ranges fan out, smallest files first.
+// Parts are split into work units of about unit_size bytes, and once the queue
+// is drained idle connections steal the tail of the slowest in-flight unit.
+// Ranges already in the journal are skipped and progress is journaled periodically.
+// With mirrors, each unit starts on the mirror with the best measured throughput.
+// With auto_tune, num_connection is only the ceiling of the tuned limit, and the
+// profiles of the hosts involved (if given) seed the limit and unit size then get updated.
+// 'progress' (if set) is called every PROGRESS_INTERVAL_MS and once at the end, the bytes
+// of each connection counted by libcurl (CURLOPT_XFERINFOFUNCTION) on this same thread.
+// 'on_transfer' (if set) receives the CURLINFO_*_TIME_T phases of every ranged GET as it ends.
+// Return true when every job completed.
+bool download_multi(Session &session, std::vector<Job> &jobs, const int num_connection, const int max_host_connection, bool auto_tune, std::map<std::string, HostProfile> *profiles, const ProgressCallback &progress, const TransferCallback &on_transfer, bool verbose)
+{
+    const auto run_begin = std::chrono::steady_clock::now() ;
+    CURLM *multi = curl_multi_init();
+    if( !multi ){
+        std::cerr << "CO-CURL::ERROR -- Cannot initialize cURL multi interface." << std::endl;
+        return false ;
+    }
+
+    Scheduler scheduler ;
+    scheduler.max_host_connection = max_host_connection ;
+    for(Job &job : jobs){
+        job.host = url_host(job.url);
+        if( job.mirrors.empty() || job.mirrors[0].url != job.url ){
+            Mirror primary ;
+            primary.url = job.url ;
+            job.mirrors.insert(job.mirrors.begin(), primary);
+        }
+        for(Mirror &mirror : job.mirrors){ mirror.host = url_host(mirror.url); }
+        job.file_size = -1 ;
+        job.planned = false ;
+        job.journaled = false ;
+        job.dirty = false ;
+        job.finished = false ;
+        job.failed = false ;
+        job.num_transfer = 0 ;
+        job.received = 0 ;
+        job.emitted = 0 ;
+        job.hashed = 0 ;
+        job.verify_s = 0.0 ;
+        job.crcs.clear();
+        job.parts.clear();
+        scheduler.push(new_transfer(job, 0, 0, PROBE_UNIT_SIZE - 1));
+    }
+
+    AutoTune tune ;
+    tune.enabled = auto_tune ;
+    if( tune.enabled ){
+        int initial = 0 ;
+        for(Job &job : jobs){
+            if( !profiles || profiles->count(job.host) == 0 ){ continue; }
+            const HostProfile &profile = profiles->at(job.host) ;
+            initial = std::max(initial, profile.connections) ;
+            if( job.unit_size < 0 && profile.unit_size > 0 ){ job.unit_size = profile.unit_size ; }
+            if( verbose ){
+                std::printf("CO-CURL:: Profile of %s: %d connections, %.1f MB/s, units of %.1f MB, RTT %.1f ms%s.\n",
+                job.host.c_str(), profile.connections, profile.rate/1E6, profile.unit_size/1E6, profile.rtt_ms, (profile.range_supported) ? "" : ", no ranges");
+            }
+        }
+        tune.start(num_connection, initial);
+    }
+
+    std::vector<CURL*> idle_handles ;
+    std::vector<Transfer*> active ;
+    std::size_t num_finished = 0 ;
+    ProgressMeter meter ;
+    while( num_finished < jobs.size() && !cancelled(session) )
+    {
+        if( progress && std::chrono::steady_clock::now() - meter.last >= std::chrono::milliseconds(PROGRESS_INTERVAL_MS) ){
+            progress(measure_progress(jobs, active, num_finished, meter));
+        }
+
+        if( tune.enabled ){
+            long long int total_bytes = 0 ;
+            for(const Job &job : jobs){ total_bytes += job.received ; }
+            if( tune.update(total_bytes) && verbose ){
+                std::printf("CO-CURL:: --auto: %d connections (%.1f MB/s over the last window).\n", tune.limit, tune.previous_rate/1E6);
+            }
+        }
+
+        // Fill free connection slots, stealing once the queue is drained
+        const int limit = (tune.enabled) ? tune.limit : num_connection ;
+        while( static_cast<int>(active.size()) < limit ){
+            Transfer *t = scheduler.pop();
+            if( !t ){
+                if( !scheduler.empty() ){ break; } // Backing off or hosts at their limit
+                t = steal_work(active, scheduler);
+                if( !t ){ break; }
+                t->mirror = scheduler.pick_mirror(*t->job) ;
+                if( verbose ){ std::printf("CO-CURL:: Stealing bytes %lld-%lld of part %d of '%s'.\n", t->start, t->end, t->part, t->job->output_filename.c_str()); }
+            }
+            Job &job = *t->job ;
+
+            if( job.failed || !open_target(job, t) ){
+                job.failed = true ;
+                if( release_transfer(t) && !job.finished ){
+                    finish_job(job, active, verbose);
+                    ++num_finished ;
+                }
+                continue;
+            }
+            t->pos = t->start ;
+            t->truncated = false ;
+            t->paused = false ;
+            t->throttled = false ;
+            t->limited = false ;
+            t->granted = false ;
+            t->limit = (session.limit.enabled()) ? &session.limit : NULL ;
+            t->bad_range = false ;
+            t->bad_mirror = false ;
+            t->journaled = false ;
+            t->response_code = 0 ;
+            t->range_start = -1 ;
+            t->range_total = -1 ;
+            t->content_length = -1 ;
+            t->started = std::chrono::steady_clock::now();
+            t->range = std::to_string(t->start) + "-" + std::to_string(t->end) ;
+            t->errbuf[0] = '\0' ;
+            t->xfer_now = 0 ;
+            t->xfer_mark = 0 ;
+            t->rate = 0.0 ;
+
+            if( !t->curl && !idle_handles.empty() ){
+                t->curl = idle_handles.back();
+                idle_handles.pop_back();
+            }
+            if( !t->curl ){ t->curl = curl_easy_init(); }
+            if( !t->curl ){
+                std::printf("CO-CURL::ERROR -- Cannot initialize cURL for downloading '%s'\n", target_filename(job, t->part).c_str());
+                close_target(job, t);
+                scheduler.push(t);
+                break;
+            }
+            setup_transfer(t->curl, session, job.mirrors[t->mirror].url);
+            curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, curl_header_unit);
+            curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, t);
+            curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, curl_write_unit);
+            curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, t);
+            curl_easy_setopt(t->curl, CURLOPT_RANGE, t->range.c_str());
+            curl_easy_setopt(t->curl, CURLOPT_ERRORBUFFER, t->errbuf);
+            curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t);
+            if( progress ){
+                curl_easy_setopt(t->curl, CURLOPT_XFERINFOFUNCTION, curl_xferinfo_unit);
+                curl_easy_setopt(t->curl, CURLOPT_XFERINFODATA, t);
+                curl_easy_setopt(t->curl, CURLOPT_NOPROGRESS, 0L);
+            }
+            curl_multi_add_handle(multi, t->curl);
+            scheduler.started(t);
+            active.push_back(t);
+        }
+
+        // Tokens again: every transfer paused by the rate limit writes once, in debt if need be,
+        // so connections share the rate evenly whatever their own speed
+        if( session.limit.enabled() ){
+            session.limit.refill();
+            const bool resume = session.limit.allow() ;
+            for(Transfer *t : active){
+                if( !t->limited || !resume ){ continue; }
+                t->limited = false ;
+                t->granted = true ;
+                curl_easy_pause(t->curl, CURLPAUSE_CONT);
+            }
+        }
+
+        int still_running = 0 ;
+        CURLMcode mc = curl_multi_perform(multi, &still_running);
+        // A transfer just finished --> collect it and start the next one now, not after the poll timeout
+        if( mc == CURLM_OK && still_running == static_cast<int>(active.size()) ){
+            int timeout_ms = scheduler.timeout_ms() ;
+            for(const Transfer *t : active){
+                if( !t->limited ){ continue; }
+                timeout_ms = std::min(timeout_ms, std::max(session.limit.wait_ms(), 1)) ;
+                break;
+            }
+            mc = curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+        }
+        if( mc != CURLM_OK ){
+            std::cerr << "CO-CURL::ERROR -- cURL multi interface failed --> " << curl_multi_strerror(mc) << std::endl;
+            break;
+        }
+
+        // First body bytes arrived: the size is known, plan then resume
+        for(Transfer *t : active){
+            if( !t->paused ){ continue; }
+            Job &job = *t->job ;
+            if( !job.planned && !job.failed ){
+                if( t->response_code == 206 && t->range_start == 0 && t->range_total > 0 ){
+                    job.file_size = t->range_total ;
+                    job.range_supported = true ;
+                }else if( t->response_code == 200 && t->content_length > 0 ){
+                    job.file_size = t->content_length ;
+                    job.range_supported = false ;
+                }else{
+                    std::cerr << "CO-CURL::ERROR -- Cannot acquire remote file size of '" << job.url << "'." << std::endl;
+                    job.failed = true ;
+                }
+                job.etag = t->etag ;
+                if( !job.failed && !plan_job(job, num_connection, t, scheduler, verbose) ){ job.failed = true ; }
+            }
+            // A failed job aborts in the write callback, the transfer is given up below
+            if( !job.failed && !open_target(job, t) ){ job.failed = true ; }
+            t->paused = false ;
+            curl_easy_pause(t->curl, CURLPAUSE_CONT);
+        }
+
+        // Hash what arrived in order, hand contiguous data to the consumer, then let throttled transfers continue
+        for(Job &job : jobs){
+            if( !job.planned || job.failed ){ continue; }
+            if( !((job.stream) ? flush_stream(job, active) : advance_digest(job, active)) ){ job.failed = true ; }
+        }
+        for(Transfer *t : active){
+            if( !t->throttled ){ continue; }
+            t->throttled = false ;
+            curl_easy_pause(t->curl, CURLPAUSE_CONT);
+        }
+
+        // Collect finished transfers
+        int msgs_left = 0 ;
+        CURLMsg *msg ;
+        while( (msg = curl_multi_info_read(multi, &msgs_left)) ){
+            if( msg->msg != CURLMSG_DONE ){ continue; }
+            Transfer *t ;
+            long response_code = 0 ;
+            CURLcode res = msg->data.result ;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&t));
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
+            curl_multi_remove_handle(multi, t->curl);
+            for(std::size_t k=0 ; k<active.size() ; ++k){
+                if( active[k] == t ){ active[k] = active.back(); active.pop_back(); break; }
+            }
+            Job &job = *t->job ;
+            scheduler.stopped(t);
+            measure_mirror(job.mirrors[t->mirror], t);
+            curl_off_t connect_us = 0 ;
+            if( curl_easy_getinfo(t->curl, CURLINFO_CONNECT_TIME_T, &connect_us) == CURLE_OK && connect_us > 0 ){
+                Mirror &mirror = job.mirrors[t->mirror] ;
+                mirror.connect_ms = (mirror.connect_ms < 0) ? connect_us/1E3 : std::min(mirror.connect_ms, connect_us/1E3) ;
+            }
+            close_target(job, t);
+
+            TransferTiming timing = TransferTiming() ;
+            if( on_transfer ){
+                timing.file = &job - &jobs[0] ;
+                timing.part = t->part ;
+                timing.host = job.mirrors[t->mirror].host ;
+                timing.start = t->start ;
+                timing.end = t->end ;
+                timing.received = t->pos - t->start ;
+                timing.attempt = t->attempt ;
+                timing.response_code = response_code ;
+                timing.begin_s = std::chrono::duration<double>(t->started - run_begin).count() ;
+                measure_timing(t->curl, timing);
+            }
+
+            std::string part_filename = target_filename(job, t->part) ;
+            bool complete = ( t->pos == t->end + 1 ) ;
+            bool retry = false ;
+            std::string error ;
+            if( job.failed ){
+                // Given up, e.g. unknown size or cannot create the output
+                error = "File given up" ;
+            }else if( t->journaled ){
+                // Nothing received, nothing to record
+                idle_handles.push_back(t->curl);
+                t->curl = NULL ;
+            }else if( response_code >= 400 ){
+                error = getHttpStatusMessage(response_code) ;
+                std::printf("CO-CURL::ERROR -- Cannot download '%s' (%d)\n", part_filename.c_str(), t->attempt);
+                std::printf("CO-CURL::ERROR -- %s.\n", error.c_str());
+                retry = is_transient_http_error(response_code) || disable_mirror(job, t->mirror) ;
+            }else if( t->bad_mirror ){
+                error = "Mirror differs in size or ETag" ;
+                std::printf("CO-CURL::ERROR -- '%s' differs in size or ETag from '%s'\n", job.mirrors[t->mirror].url.c_str(), job.url.c_str());
+                retry = disable_mirror(job, t->mirror) ;
+            }else if( t->bad_range ){
+                error = "Range not honored" ;
+                std::printf("CO-CURL::ERROR -- Server did not honor range %s of '%s' (%d)\n", t->range.c_str(), part_filename.c_str(), t->attempt);
+                retry = true ;
+            }else if( job.planned && complete && (res == CURLE_OK || (res == CURLE_WRITE_ERROR && t->truncated)) ){
+                record_received(job, t, t->end);
+                job.dirty = true ;
+                if( verbose ){ std::printf("CO-CURL:: Finish downloading bytes %lld-%lld of '%s' -- %s\n", t->start, t->end, part_filename.c_str(), getHttpStatusMessage(response_code).c_str()); }
+                ++tune.completions ;
+                idle_handles.push_back(t->curl);
+                t->curl = NULL ;
+            }else if( res != CURLE_OK ){
+                error = (t->errbuf[0]) ? t->errbuf : curl_easy_strerror(res) ;
+                std::printf("CO-CURL::ERROR -- Cannot download '%s' (%d)\n --> %s\n", part_filename.c_str(), t->attempt, error.c_str());
+                retry = true ;
+            }else{
+                error = "Incomplete range" ;
+                std::printf("CO-CURL::ERROR -- Received %lld of %lld bytes for '%s' (%d)\n", t->pos - t->start, t->end - t->start + 1, part_filename.c_str(), t->attempt);
+                retry = true ;
+            }
+            if( on_transfer ){
+                timing.ok = error.empty() ;
+                timing.error = error ;
+                on_transfer(timing);
+            }
+
+            if( t->curl ){
+                if( !job.failed ){ ++tune.failures ; }
+                // Keep what was received, retry only the remaining range
+                if( job.planned && t->pos > t->start ){
+                    if( t->pos - t->start >= MIN_UNIT_SIZE ){ t->attempt = 0 ; }
+                    record_received(job, t, t->pos - 1);
+                    job.dirty = true ;
+                    t->start = t->pos ;
+                }
+                if( retry && ++t->attempt < NUM_TRY_DOWNLOAD ){
+                    std::chrono::milliseconds delay = retry_delay(t->attempt);
+                    t->not_before = std::chrono::steady_clock::now() + delay ;
+                    std::printf("CO-CURL:: Retrying bytes %lld-%lld of '%s' in %.1f s.\n", t->start, t->end, part_filename.c_str(), delay.count()/1E3);
+                    scheduler.push(t);
+                    continue;
+                }
+                job.failed = true ;
+            }
+
+            if( release_transfer(t) && !job.finished ){
+                if( job.stream && job.planned && !job.failed && !flush_stream(job, active) ){ job.failed = true ; }
+                finish_job(job, active, verbose);
+                ++num_finished ;
+            }
+        }
+
+        for(Job &job : jobs){
+            if( job.journaled && job.dirty && !job.finished && journal_due(job.journal) ){
+                sync_journal(job, active);
+            }
+        }
+    }
+
+    if( cancelled(session) ){ std::cerr << "CO-CURL::WARNING -- Interrupted." << std::endl; }
+    for(Transfer *t : active){
+        curl_multi_remove_handle(multi, t->curl);
+        if( t->job->planned && t->pos > t->start ){ record_received(*t->job, t, t->pos - 1); }
+        close_target(*t->job, t);
+    }
+    for(Job &job : jobs){
+        if( !job.finished ){ finish_job(job, active, verbose); }
+    }
+
+    // Only non-empty on failure or interruption
+    scheduler.drain(active);
+    for(Transfer *t : active){ release_transfer(t); }
+    for(CURL *curl : idle_handles){ curl_easy_cleanup(curl); }
+    curl_multi_cleanup(multi);
+
+    if( tune.enabled ){
+        std::printf("CO-CURL:: --auto: %.1f MB/s reached with %d connections, finished with %d.\n", tune.best_rate/1E6, tune.best_limit, tune.limit);
+    }
+    if( tune.enabled && profiles ){
+        // One window at least for the connection count, per-connection rate and RTT from the mirrors
+        for(const Job &job : jobs){
+            for(const Mirror &mirror : job.mirrors){
+                HostProfile &profile = (*profiles)[mirror.host] ;
+                if( tune.best_rate > 0.0 && mirror.host == job.host ){
+                    profile.connections = tune.best_limit ;
+                    profile.rate = tune.best_rate ;
+                }
+                if( mirror.rate > 0.0 ){ profile.unit_size = std::max(static_cast<long long int>(mirror.rate*UNIT_TARGET_S), static_cast<long long int>(MIN_UNIT_SIZE)) ; }
+                if( mirror.connect_ms > 0.0 ){ profile.rtt_ms = mirror.connect_ms ; }
+                if( job.planned && mirror.host == job.host ){ profile.range_supported = job.range_supported ; }
+                profile.updated = std::time(NULL) ;
+            }
+        }
+    }
+
+    if( progress ){ progress(measure_progress(jobs, std::vector<Transfer*>(), jobs.size(), meter)); }
+    bool completed = true ;
+    for(const Job &job : jobs){ completed = completed && !job.failed ; }
+
+return completed; }
+
+
+int check_files(const std::string &filename, const int num_part, const std::uintmax_t chunk_size, const std::uintmax_t last_part_size)
+{
+    int all_present = 1 ;
+
+    for(int i=0 ; i<num_part ; ++i)
+    {
+        fs::path part_filepath = filename + ".part" + std::to_string(i) ;
+        if( fs::is_empty(part_filepath) ){
+            std::cerr << "CO-CURL::ERROR -- '" << part_filepath.c_str() << "' is not found." << std::endl;
+            all_present = 0 ;
+        }
+        if( i != num_part-1 ){
+            if( fs::file_size(part_filepath) + 1E6 < chunk_size ){
+                std::cerr << "CO-CURL::WARNING -- '" << part_filepath.c_str() << "' is >1MB smaller than expected. All parts will not be removed as a precaution" << std::endl;
+                all_present = -1 ;
+            }
+        }else{
+            if( fs::file_size(part_filepath) + 1E6 < last_part_size ){
+                std::cerr << "CO-CURL::WARNING -- '" << part_filepath.c_str() << "' is >1MB smaller than expected. All parts will not be removed as a precaution." << std::endl;
+                all_present = -1 ;
+           }
+        }
+    }
+
+return all_present; }
+
+
+// Copy 'length' bytes of in_fd from offset 0 to out_fd at out_offset inside the kernel:
+// reflink (FICLONERANGE) when the filesystem shares extents, else copy_file_range(),
+// else pread/pwrite through a large buffer (e.g. across filesystems or on old kernels).
+bool copy_part(int in_fd, int out_fd, long long int out_offset, long long int length)
+{
+#ifdef FICLONERANGE
+    // Needs block aligned offsets, the tail may end at EOF
+    struct stat out_stat ;
+    if( length > 0 && fstat(out_fd, &out_stat) == 0 && out_stat.st_blksize > 0 && out_offset % out_stat.st_blksize == 0 ){
+        struct file_clone_range clone = {in_fd, 0, static_cast<__u64>(length), static_cast<__u64>(out_offset)} ;
+        if( ioctl(out_fd, FICLONERANGE, &clone) == 0 ){ return true ; }
+    }
+#endif
+
+    off_t in_offset = 0 ;
+    off_t offset = out_offset ;
+    long long int remain = length ;
+    while( remain > 0 ){
+        ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, &offset, remain, 0);
+        if( copied < 0 && errno == EINTR ){ continue; }
+        if( copied <= 0 ){ break; }
+        remain -= copied ;
+    }
+    if( remain == 0 ){ return true ; }
+
+    std::vector<char> buffer(MERGE_BUFFER_SIZE) ;
+    while( remain > 0 ){
+        ssize_t got = pread(in_fd, buffer.data(), std::min(remain, static_cast<long long int>(buffer.size())), in_offset);
+        if( got < 0 && errno == EINTR ){ continue; }
+        if( got <= 0 ){ return false ; }
+        for(ssize_t done = 0 ; done < got ; ){
+            ssize_t written = pwrite(out_fd, buffer.data() + done, got - done, offset);
+            if( written < 0 && errno == EINTR ){ continue; }
+            if( written <= 0 ){ return false ; }
+            done += written ;
+            offset += written ;
+        }
+        in_offset += got ;
+        remain -= got ;
+    }
+
+return true; }
+
+
+// Copy every part to its offset in the preallocated output, num_thread parts at a time
+bool merge_files(const std::string &output_filename, int num_part, const int num_thread, bool verbose)
+{
+    bool normal_exit = true ;
+
+    std::vector<int> part_fds(num_part, -1) ;
+    std::vector<long long int> offsets(num_part + 1, 0) ;
+    for(int i=0 ; i<num_part ; ++i)
+    {
+        std::string part_filename = output_filename + ".part" + std::to_string(i) ;
+
+        if( verbose ){ std::cout << "--> Opening '" << part_filename << "'." << std::endl; }
+        part_fds[i] = open(part_filename.c_str(), O_RDONLY);
+        struct stat part_stat ;
+
+        if( part_fds[i] < 0 || fstat(part_fds[i], &part_stat) != 0 ){
+            std::cerr << "CO-CRUL::ERROR -- Cannot open '" << part_filename << "'." << std::endl;
+            normal_exit = false ;
+            break;
+        }
+        offsets[i+1] = offsets[i] + part_stat.st_size ;
+    }
+
+    int output_fd = -1 ;
+    if( normal_exit ){
+        if( verbose ){ std::cout << "--> Creating / Opening '" << output_filename << "'." << std::endl; }
+        output_fd = open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if( output_fd < 0 || !preallocate_file(output_fd, offsets[num_part]) ) {
+            std::cerr << "CO-CURL::ERROR -- Cannot create '" << output_filename << "'." << std::endl;
+            normal_exit = false ;
+        }
+    }
+
+    if( normal_exit ){
+        omp_set_num_threads(std::min(num_thread, num_part));
+        #pragma omp parallel for schedule(dynamic)
+        for(int i=0 ; i<num_part ; ++i)
+        {
+            if( verbose ){ std::printf("--> Thread %2d -- Merging '%s.part%d'.\n", omp_get_thread_num(), output_filename.c_str(), i); }
+            if( !copy_part(part_fds[i], output_fd, offsets[i], offsets[i+1] - offsets[i]) ){
+                std::printf("CO-CURL::ERROR -- Cannot merge '%s.part%d' --> %s\n", output_filename.c_str(), i, std::strerror(errno));
+                #pragma omp atomic write
+                normal_exit = false ;
+            }
+        }
+    }
+
+    for(int fd : part_fds){ if( fd >= 0 ){ close(fd); } }
+    if( output_fd >= 0 ){
+        if( verbose ){ std::cout << "--> Closing '" << output_filename << "'." << std::endl; }
+        if( close(output_fd) != 0 ){ normal_exit = false ; }
+    }
+
+return normal_exit; }
+
+
+// Check, Merge, Remove
+bool finalize_parts(const std::string &output_filename, const int num_part, const long long int chunk_size, const long long int file_size, const int num_thread, bool verbose)
+{
+    bool normal_exit = true ;
+
+    if( verbose ){ std::cout << "--> Checking part files." << std::endl; }
+    int part_status = check_files(output_filename, num_part, chunk_size, file_size - (num_part-1)*chunk_size) ;
+
+    if( part_status != 0 ){
+        if( verbose ){ std::cout << "--> Starting merging part files." << std::endl; }
+        normal_exit = merge_files(output_filename, num_part, num_thread, verbose);
+    }else{
+        std::cerr << "CO-CURL::ERROR -- Some parts are missing." << std::endl;
+        normal_exit = false ;
+    }
+
+    if( normal_exit ){
+        if( part_status == 1 ){
+            for(int i=0 ; i<num_part ; ++i){
+                if( verbose ){ std::cout << "--> Deleting '" << output_filename + ".part" + std::to_string(i) << "'."  << std::endl; }
+                std::remove( (output_filename + ".part" + std::to_string(i)).c_str() );
+            }
+        }
+    }else{
+        if( verbose ){ std::cout << "--> Deleting '" << output_filename << "'." << std::endl; }
+        std::remove( output_filename.c_str() );
+    }
+
+return normal_exit; }
+
+
+std::string xml_unescape(std::string text)
+{
+    static const std::pair<const char*, const char*> entities[] = {{"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {"&amp;", "&"}} ;
+    for(const auto &e : entities){
+        for(std::size_t pos = text.find(e.first) ; pos != std::string::npos ; pos = text.find(e.first, pos + 1)){
+            text.replace(pos, std::strlen(e.first), e.second);
+        }
+    }
+
+return text; }
+
+
+// Value of attribute 'name' in an XML start tag, empty if absent
+std::string xml_attribute(const std::string &tag, const std::string &name)
+{
+    for(char quote : {'"', '\''}){
+        std::size_t pos = tag.find(" " + name + "=" + quote);
+        if( pos == std::string::npos ){ continue; }
+        pos += name.size() + 3 ;
+        return xml_unescape(tag.substr(pos, tag.find(quote, pos) - pos)) ;
+    }
+
+return ""; }
+
+
+// Elements <name ...>text</name> in 'body' as (start tag, text)
+std::vector<std::pair<std::string, std::string>> xml_elements(const std::string &body, const std::string &name)
+{
+    std::vector<std::pair<std::string, std::string>> elements ;
+    const std::string open = "<" + name, close = "</" + name + ">" ;
+    for(std::size_t pos = body.find(open) ; pos != std::string::npos ; pos = body.find(open, pos + 1)){
+        std::size_t tag_end = body.find('>', pos);
+        if( tag_end == std::string::npos ){ break; }
+        char next = body[pos + open.size()] ;
+        if( next != ' ' && next != '>' && next != '\t' && next != '\n' && next != '\r' ){ continue; }
+        std::size_t end = body.find(close, tag_end);
+        if( end == std::string::npos ){ break; }
+        std::string text = xml_unescape(body.substr(tag_end + 1, end - tag_end - 1));
+        text.erase(0, text.find_first_not_of(" \t\r\n"));
+        text.erase(text.find_last_not_of(" \t\r\n") + 1);
+        elements.push_back(std::make_pair(body.substr(pos, tag_end - pos), text));
+    }
+
+return elements; }
+
+
+// Metalink 4 (RFC 5854) or 3: one job per <file>, its <url>s as mirrors by priority,
+// a whole-file sha-256 or md5 <hash> as the checksum
+bool read_metalink(const std::string &text, const std::string &input_filename, std::vector<Request> &requests)
+{
+    for(const auto &file : xml_elements(text, "file")){
+        std::string name = xml_attribute(file.first, "name") ;
+        name = name.substr(name.find_last_of('/') + 1);
+        std::vector<std::pair<int, std::string>> urls ;
+        for(const auto &url : xml_elements(file.second, "url")){
+            std::string priority = xml_attribute(url.first, "priority") ;
+            std::string preference = xml_attribute(url.first, "preference") ;
+            int rank = (!priority.empty()) ? std::atoi(priority.c_str()) : (!preference.empty()) ? -std::atoi(preference.c_str()) : 0 ;
+            if( !url.second.empty() ){ urls.push_back(std::make_pair(rank, url.second)); }
+        }
+        std::stable_sort(urls.begin(), urls.end(), [](const std::pair<int, std::string> &a, const std::pair<int, std::string> &b){ return a.first < b.first ; });
+        if( name.empty() || urls.empty() ){
+            std::cerr << "CO-CURL::ERROR -- A <file> without name or url in '" << input_filename << "'." << std::endl;
+            return false ;
+        }
+
+        Request request ;
+        request.url = urls[0].second ;
+        request.output_filename = name ;
+        for(std::size_t k=1 ; k<urls.size() ; ++k){ request.mirrors.push_back(urls[k].second); }
+        for(const char *type : {"sha-256", "sha256", "md5"}){
+            for(const auto &hash : xml_elements(file.second, "hash")){
+                if( !request.checksum.empty() || xml_attribute(hash.first, "type") != type || !xml_attribute(hash.first, "piece").empty() ){ continue; }
+                std::string algorithm = (std::strcmp(type, "md5") == 0) ? "md5" : "sha256" ;
+                if( !valid_checksum(algorithm + ":" + hash.second) ){ continue; }
+                request.checksum = algorithm + ":" + hash.second ;
+                request.checksum_source = input_filename ;
+            }
+        }
+        requests.push_back(request);
+    }
+    if( requests.empty() ){
+        std::cerr << "CO-CURL::ERROR -- No <file> in '" << input_filename << "'." << std::endl;
+        return false ;
+    }
+
+return true; }
+
+
+// One "<url> [output [checksum]]" per line, '#' comments, output defaults to the last url segment
+// (or a Metalink file)
+bool read_manifest(const std::string &input_filename, std::vector<Request> &requests)
+{
+    std::ifstream input_file(input_filename.c_str());
+    if( !input_file.is_open() ){
+        std::cerr << "CO-CURL::ERROR -- Cannot open '" << input_filename << "'." << std::endl;
+        return false ;
+    }
+    std::stringstream content ;
+    content << input_file.rdbuf();
+    std::string text = content.str();
+    std::size_t first = text.find_first_not_of(" \t\r\n");
+    if( first != std::string::npos && text[first] == '<' ){ return read_metalink(text, input_filename, requests) ; }
+
+    std::string line ;
+    int line_number = 0 ;
+    while( std::getline(content, line) ){
+        ++line_number ;
+        std::istringstream fields(line);
+        std::string url, output_filename ;
+        if( !(fields >> url) || url[0] == '#' ){ continue; }
+        if( !(fields >> output_filename) ){
+            output_filename = url.substr(url.find_last_of('/') + 1) ;
+        }
+        if( output_filename.empty() ){
+            std::cerr << "CO-CURL::ERROR -- No output filename for '" << url << "' (" << input_filename << ":" << line_number << ")." << std::endl;
+            return false ;
+        }
+        Request request ;
+        request.url = url ;
+        request.output_filename = output_filename ;
+        if( fields >> request.checksum ){
+            if( !valid_checksum(request.checksum) ){
+                std::cerr << "CO-CURL::ERROR -- Invalid checksum '" << request.checksum << "' (" << input_filename << ":" << line_number << ")." << std::endl;
+                return false ;
+            }
+            request.checksum_source = input_filename ;
+        }
+        requests.push_back(request);
+    }
+    if( requests.empty() ){
+        std::cerr << "CO-CURL::ERROR -- No url in '" << input_filename << "'." << std::endl;
+        return false ;
+    }
+
+return true; }
+
+
+bool MemorySink::open(long long int file_size)
+{
+    data.assign(file_size, 0);
+return true; }
+
+
+bool MemorySink::write(long long int offset, const char *bytes, std::size_t size)
+{
+    if( offset < 0 || offset + size > data.size() ){ return false ; }
+    std::memcpy(data.data() + offset, bytes, size);
+return true; }
+
+
+bool MemorySink::read(long long int offset, char *bytes, std::size_t size)
+{
+    if( offset < 0 || offset + size > data.size() ){ return false ; }
+    std::memcpy(bytes, data.data() + offset, size);
+return true; }
+
+
+bool FileSink::write(long long int offset, const char *data, std::size_t size)
+{
+    while( size > 0 ){
+        ssize_t written = pwrite(fd, data, size, base + offset);
+        if( written < 0 && errno == EINTR ){ continue; }
+        if( written <= 0 ){ return false ; }
+        data += written ;
+        size -= written ;
+        offset += written ;
+    }
+return true; }
+
+
+bool FileSink::read(long long int offset, char *data, std::size_t size)
+{
+    while( size > 0 ){
+        ssize_t got = pread(fd, data, size, base + offset);
+        if( got < 0 && errno == EINTR ){ continue; }
+        if( got <= 0 ){ return false ; }
+        data += got ;
+        size -= got ;
+        offset += got ;
+    }
+return true; }
+
+
+bool CallbackSink::write(long long int offset, const char *data, std::size_t size)
+{
+    return callback(offset, data, size) ;
+}
+
+
+bool valid_checksum(const std::string &spec)
+{
+    Checksum checksum ;
+    return parse_checksum(spec, checksum) ;
+}
+
+
+bool self_test()
+{
+    bool ok = true ;
+    auto check = [&ok](const char *name, const std::string &got, const std::string &expected){
+        if( got != expected ){
+            std::cerr << "CO-CURL::ERROR -- Self-test " << name << ": " << got << " instead of " << expected << std::endl;
+            ok = false ;
+        }
+    };
+    auto sha256 = [](const std::string &text){ Sha256 h ; h.update(text.data(), text.size()); return to_hex(h.final()) ; };
+    auto md5 = [](const std::string &text){ Md5 h ; h.update(text.data(), text.size()); return to_hex(h.final()) ; };
+    auto hex32 = [](uint32_t crc){ char text[9] ; std::snprintf(text, sizeof(text), "%08x", crc); return std::string(text) ; };
+
+    // FIPS 180-2
+    check("sha256 \"\"", sha256(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    check("sha256 abc", sha256("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    check("sha256 448 bits", sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    {
+        const std::string a(1000, 'a') ;
+        Sha256 h ;
+        for(std::size_t done=0, step=1 ; done < 1000000 ; done += step, step = step % 997 + 1){
+            step = std::min(step, static_cast<std::size_t>(1000000 - done));
+            h.update(a.data(), step);
+        }
+        check("sha256 1M a", to_hex(h.final()), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    }
+
+    // RFC 1321
+    check("md5 \"\"", md5(""), "d41d8cd98f00b204e9800998ecf8427e");
+    check("md5 a", md5("a"), "0cc175b9c0f1b6a831c399e269772661");
+    check("md5 abc", md5("abc"), "900150983cd24fb0d6963f7d28e17f72");
+    check("md5 message digest", md5("message digest"), "f96b697d7cb7938d525a2f31aaf161d0");
+    check("md5 a-z", md5("abcdefghijklmnopqrstuvwxyz"), "c3fcd3d76192e4007dfb496cca67e13b");
+    check("md5 A-Za-z0-9", md5("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"), "d174ab98d277d9f5a5611c2c9f419d9f");
+    std::string digits ;
+    for(int n=0 ; n<8 ; ++n){ digits += "1234567890" ; }
+    check("md5 8x1234567890", md5(digits), "57edf4a22be3c955ac49da2e2107b67a");
+
+    // RFC 3720 B.4
+    check("crc32c 123456789", hex32(crc32c(0, "123456789", 9)), "e3069283");
+    const std::string zeros(32, '\0') ;
+    check("crc32c 32 zeros", hex32(crc32c(0, zeros.data(), zeros.size())), "8a9136aa");
+
+    std::string buffer(4099, '\0') ;
+    uint32_t state = 0x12345678 ;
+    for(char &c : buffer){ state = state*1664525u + 1013904223u ; c = static_cast<char>(state >> 24) ; }
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(buffer.data());
+    const uint32_t whole = crc32c(0, buffer.data(), buffer.size()) ;
+    check("crc32c table", hex32(~crc32c_table(~0u, p, buffer.size())), hex32(whole));
+#if defined(__x86_64__)
+    if( __builtin_cpu_supports("sse4.2") ){
+        // Every alignment and tail length of both paths
+        for(std::size_t offset=0 ; offset<8 && ok ; ++offset){
+            for(std::size_t n=0 ; n<=64 && ok ; ++n){
+                check("crc32c sse4.2", hex32(crc32c_sse42(~0u, p + offset, n)), hex32(crc32c_table(~0u, p + offset, n)));
+            }
+        }
+        check("crc32c sse4.2", hex32(~crc32c_sse42(~0u, p, buffer.size())), hex32(whole));
+    }
+#endif
+
+    const std::size_t splits[] = {0, 1, 7, 8, 9, 1000, 4096, buffer.size()} ;
+    for(std::size_t split : splits){
+        const uint32_t head = crc32c(0, buffer.data(), split) ;
+        const uint32_t tail = crc32c(0, buffer.data() + split, buffer.size() - split) ;
+        check("crc32c_combine", hex32(crc32c_combine(head, tail, buffer.size() - split)), hex32(whole));
+    }
+
+return ok; }
+
+
+// "500M", "1.5G", "800K" or bytes/s, -1 when invalid
+long long int parse_rate(const std::string &text)
+{
+    char *end = NULL ;
+    const double value = std::strtod(text.c_str(), &end);
+    if( end == text.c_str() || !std::isfinite(value) || value < 0.0 ){ return -1 ; }
+    const std::string suffix(end) ;
+    double scale = 1.0 ;
+    if( suffix == "K" || suffix == "k" ){ scale = 1E3 ; }
+    else if( suffix == "M" || suffix == "m" ){ scale = 1E6 ; }
+    else if( suffix == "G" || suffix == "g" ){ scale = 1E9 ; }
+    else if( !suffix.empty() ){ return -1 ; }
+    // Below 2^63, so llround() is defined
+    if( value*scale >= 9.2E18 ){ return -1 ; }
+return std::llround(value*scale); }
+
+
+// "hh:mm" --> minutes since midnight, -1 when invalid
+int parse_time_of_day(const std::string &text)
+{
+    int hours, minutes ;
+    char extra ;
+    if( std::sscanf(text.c_str(), "%d:%d%c", &hours, &minutes, &extra) != 2 ){ return -1 ; }
+    if( hours < 0 || minutes < 0 || minutes > 59 || hours*60 + minutes > 24*60 ){ return -1 ; }
+return hours*60 + minutes; }
+
+
+bool parse_rate_limit(const std::string &spec, long long int &rate, std::vector<RateWindow> &schedule)
+{
+    rate = 0 ;
+    schedule.clear();
+    std::istringstream items(spec);
+    std::string item ;
+    while( std::getline(items, item, ',') ){
+        std::size_t at = item.find('@');
+        const long long int value = parse_rate(item.substr(0, at)) ;
+        if( value < 0 ){ return false ; }
+        if( at == std::string::npos ){
+            rate = value ;
+            continue;
+        }
+        std::string window = item.substr(at + 1) ;
+        std::size_t dash = window.find('-');
+        if( dash == std::string::npos ){ return false ; }
+        RateWindow w ;
+        w.begin_minute = parse_time_of_day(window.substr(0, dash)) ;
+        w.end_minute = parse_time_of_day(window.substr(dash + 1)) ;
+        w.rate = value ;
+        if( w.begin_minute < 0 || w.end_minute < 0 ){ return false ; }
+        schedule.push_back(w);
+    }
+
+return !spec.empty(); }
+
+
+// curl_global_init() before the first Downloader (or AsyncClient), curl_global_cleanup() after the last one
+std::mutex global_mutex ;
+int num_global_users = 0 ;
+
+void global_init()
+{
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if( num_global_users++ == 0 ){ curl_global_init(CURL_GLOBAL_ALL); }
+}
+
+
+void global_cleanup()
+{
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if( --num_global_users == 0 ){ curl_global_cleanup(); }
+}
+
+
+struct Downloader::Impl {
+    Options options ;
+    Session session ;
+    ProgressCallback progress ;
+    TransferCallback on_transfer ;
+
+    int connections(bool auto_tune) const {
+        if( options.num_connection > 0 ){ return options.num_connection ; }
+        return (auto_tune) ? AUTO_MAX_CONNECTIONS : options.num_thread ;
+    }
+
+    // Size and part layout of url for download_part() and merge_parts()
+    bool layout(const std::string &url, long long int &file_size, int &num_part, long long int &chunk_size){
+        file_size = get_file_size(session, url, options.verbose);
+        if( file_size <= 0 ){ return false ; }
+        num_part = options.num_part ;
+        chunk_size = options.chunk_size ;
+        long long int unit_size = options.unit_size ;
+        plan_layout(file_size, connections(false), num_part, chunk_size, unit_size);
+        return true ;
+    }
+
+    // Too small to split: the whole file at once
+    bool download_small(const std::string &url, const std::string &output_filename, const long long int file_size){
+        if( options.verbose ){
+            std::cout << "\n"
+            << " From URL: " << url << "\n"
+            << " Download: " << output_filename << "\n"
+            << " Having about " << file_size/1E6 << " MB.\n"
+            << std::endl;
+        }
+        return cocurl::download(session, output_filename, url, 0, file_size-1, "", options.verbose) ;
+    }
+};
+
+
+Downloader::Downloader(const Options &options) : impl(new Impl)
+{
+    impl->options = options ;
+    impl->session.user.username = options.username ;
+    impl->session.user.password = options.password ;
+    impl->session.limit.rate = options.limit_rate ;
+    impl->session.limit.burst = options.limit_burst ;
+    impl->session.limit.schedule = options.limit_schedule ;
+    if( options.verbose ){ std::cout << "--> Initializing cURL." << std::endl; }
+    global_init();
+    init_session(impl->session);
+}
+
+
+Downloader::~Downloader()
+{
+    if( impl->options.verbose ){ std::cout << "--> Cleaning up cRUL." << std::endl; }
+    cleanup_session(impl->session);
+    global_cleanup();
+}
+
+
+void Downloader::on_progress(ProgressCallback callback){ impl->progress = std::move(callback); }
+
+void Downloader::on_transfer(TransferCallback callback){ impl->on_transfer = std::move(callback); }
+
+void Downloader::set_cancellation(const CancellationToken *token){ impl->session.cancellation = token ; }
+
+long long int Downloader::file_size(const std::string &url){ return get_file_size(impl->session, url, impl->options.verbose) ; }
+
+
+bool Downloader::download(std::vector<Request> &requests)
+{
+    const Options &options = impl->options ;
+    const int num_connection = impl->connections(options.auto_tune) ;
+    const int max_host_connection = (options.max_host_connection < 0) ? num_connection : std::min(options.max_host_connection, num_connection) ;
+
+    // No separate size request, the first ranged GET reveals it
+    std::vector<Job> jobs(requests.size()) ;
+    bool valid = true ;
+    for(std::size_t k=0 ; k<requests.size() ; ++k)
+    {
+        Request &request = requests[k] ;
+        Job &job = jobs[k] ;
+        request.completed = false ;
+        request.file_size = -1 ;
+        job.url = request.url ;
+        job.output_filename = (request.output_filename.empty()) ? request.url.substr(request.url.find_last_of('/') + 1) : request.output_filename ;
+        for(const std::string &url : request.mirrors){
+            Mirror mirror ;
+            mirror.url = url ;
+            job.mirrors.push_back(mirror);
+        }
+        job.num_part = options.num_part ;
+        job.chunk_size = options.chunk_size ;
+        job.unit_size = options.unit_size ;
+        job.direct_write = options.direct_write ;
+        job.sink = request.sink ;
+        job.stream = ( !job.sink && job.output_filename == "-" ) ;
+        job.stream_fd = options.stream_fd ;
+        job.max_buffer = options.max_buffer ;
+
+        const std::string &checksum = (request.checksum.empty()) ? options.checksum : request.checksum ;
+        if( !checksum.empty() && !parse_checksum(checksum, job.checksum) ){
+            std::cerr << "CO-CURL::ERROR -- Invalid checksum '" << checksum << "' for '" << job.url << "'." << std::endl;
+            valid = false ;
+        }
+        if( !request.checksum.empty() && !request.checksum_source.empty() ){ job.checksum.source = request.checksum_source ; }
+        if( job.output_filename.empty() && !job.sink ){
+            std::cerr << "CO-CURL::ERROR -- No output filename for '" << job.url << "'." << std::endl;
+            valid = false ;
+        }
+        if( job.stream && job.stream_fd < 0 ){
+            std::cerr << "CO-CURL::ERROR -- No output stream for '" << job.url << "' (-)." << std::endl;
+            valid = false ;
+        }
+    }
+    if( !valid ){ return false ; }
+
+    std::map<std::string, HostProfile> profiles, updates ;
+    const std::string profile_file = (options.auto_tune && options.use_profiles) ? profile_filename() : "" ;
+    const long long int run_start = std::time(NULL) ;
+    if( !profile_file.empty() ){ load_profiles(profile_file, profiles); }
+    bool completed = download_multi(impl->session, jobs, num_connection, max_host_connection, options.auto_tune, (profile_file.empty()) ? NULL : &profiles, impl->progress, impl->on_transfer, options.verbose);
+    for(const auto &p : profiles){
+        if( p.second.updated >= run_start ){ updates.insert(p); }
+    }
+    if( !updates.empty() && !save_profiles(profile_file, updates) && options.verbose ){
+        std::cerr << "CO-CURL::WARNING -- Cannot save host profiles to '" << profile_file << "'." << std::endl;
+    }
+
+    // Check, Merge, Remove
+    for(std::size_t k=0 ; k<jobs.size() ; ++k)
+    {
+        const Job &job = jobs[k] ;
+        bool done = !job.failed ;
+        requests[k].merge_s = 0.0 ;
+        if( done && !job.direct_write && !job.stream ){
+            const auto merge_begin = std::chrono::steady_clock::now() ;
+            done = finalize_parts(job.output_filename, job.num_part, job.chunk_size, job.file_size, options.num_thread, options.verbose);
+            requests[k].merge_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - merge_begin).count() ;
+        }
+        requests[k].completed = done ;
+        requests[k].verify_s = job.verify_s ;
+        requests[k].file_size = (job.planned) ? job.file_size : -1 ;
+        completed = completed && done ;
+    }
+
+return completed; }
+
+
+bool Downloader::download_part(const std::string &url, const std::string &output_filename, int part_index)
+{
+    long long int file_size, chunk_size ;
+    int num_part ;
+    if( !impl->layout(url, file_size, num_part, chunk_size) ){ return false ; }
+    if( file_size < MIN_FILE_SIZE_FOR_PARALLEL ){ return impl->download_small(url, output_filename, file_size) ; }
+
+    if( part_index < 0 || part_index > num_part-1 ){
+        std::cerr
+        << "CO-CURL::ERROR -- Invalid input for option -s,--single-part, incorrect file index "
+        << part_index << " is not in range [0-" << num_part-1 << "]." << std::endl;
+        return false ;
+    }
+    if( impl->options.verbose ){
+        std::cout << "\n"
+        << " From URL: " << url << "\n"
+        << " Download: " << output_filename << ".part" << part_index << "\n"
+        << " From totally " << num_part << " parts, each about " << chunk_size/1E6 << " MB.\n"
+        << "\n"
+        << " Note: replace -s,--single-part <index> with -m,--merge option to merge them.\n"
+        << std::endl;
+    }
+
+    const int i = part_index ;
+    long long int start = i*chunk_size ;
+    long long int end = (i==num_part-1)  ?  file_size - 1 : start + chunk_size - 1 ;
+    std::string part_filename = output_filename + ".part" + std::to_string(i) ;
+
+return cocurl::download(impl->session, part_filename, url, start, end, journal_header(url, file_size, num_part, chunk_size, false), impl->options.verbose); }
+
+
+bool Downloader::merge_parts(const std::string &url, const std::string &output_filename)
+{
+    long long int file_size, chunk_size ;
+    int num_part ;
+    if( !impl->layout(url, file_size, num_part, chunk_size) ){ return false ; }
+    if( file_size < MIN_FILE_SIZE_FOR_PARALLEL ){ return impl->download_small(url, output_filename, file_size) ; }
+
+    if( impl->options.verbose ){
+        std::cout << "\n"
+        << " Output: " << output_filename << "\n"
+        << " Merging " << num_part << " parts, each about " << chunk_size/1E6 << " MB.\n"
+        << std::endl;
+    }
+
+return finalize_parts(output_filename, num_part, chunk_size, file_size, impl->options.num_thread, impl->options.verbose); }
+
+
+// Decimal digits only, -1 when empty, not a number or out of range
+long long int parse_position(const std::string &text)
+{
+    if( text.empty() || text.find_first_not_of("0123456789") != std::string::npos ){ return -1 ; }
+    errno = 0 ;
+    long long int value = std::strtoll(text.c_str(), NULL, 10) ;
+    if( errno == ERANGE ){ return -1 ; }
+return value; }
+
+
+bool parse_byte_ranges(const std::string &spec, long long int file_size, std::vector<ByteRange> &ranges)
+{
+    if( file_size <= 0 ){ return false ; } // Empty or unknown size, no byte to address
+    std::istringstream items(spec);
+    std::string item ;
+    while( std::getline(items, item, ',') ){
+        std::size_t dash = item.find('-');
+        if( dash == std::string::npos ){ return false ; }
+        std::string first = item.substr(0, dash), last = item.substr(dash + 1) ;
+        long long int from = (first.empty()) ? -1 : parse_position(first) ;
+        long long int to = (last.empty()) ? -1 : parse_position(last) ;
+        if( (first.empty() && last.empty()) || (!first.empty() && from < 0) || (!last.empty() && to < 0) ){ return false ; }
+        ByteRange range ;
+        if( first.empty() ){
+            if( to == 0 ){ return false ; } // "-0", no byte
+            range.offset = std::max(file_size - to, 0LL) ;
+            range.length = file_size - range.offset ;
+        }else{
+            if( from >= file_size || (to >= 0 && to < from) ){ return false ; }
+            range.offset = from ;
+            long long int end = (to < 0) ? file_size - 1 : std::min(to, file_size - 1) ;
+            range.length = end - range.offset + 1 ;
+        }
+        ranges.push_back(range);
+    }
+
+return !ranges.empty(); }
+
+
+// One multi-range GET, the whole body kept to be split into its parts
+struct MultiRangeResponse {
+    long response_code = 0 ;
+    long long int range_start = -1 ;   // Single-part 206, the server merged the ranges
+    std::string content_type ;
+    std::string body ;
+    bool whole = false ;               // 200, the Range header was ignored
+    Session *session = NULL ;
+};
+
+
+size_t curl_header_multirange(char *buffer, size_t size, size_t nitems, MultiRangeResponse *r){
+    const size_t length = size*nitems ;
+    std::string line(buffer, length);
+    if( line.compare(0, 5, "HTTP/") == 0 ){
+        std::size_t pos = line.find(' ');
+        r->response_code = (pos != std::string::npos) ? std::atol(line.c_str() + pos + 1) : 0 ;
+        r->range_start = -1 ;
+        r->content_type.clear();
+    }else if( strncasecmp(line.c_str(), "content-range:", 14) == 0 ){
+        long long int first ;
+        if( std::sscanf(line.c_str() + 14, " bytes %lld-", &first) == 1 ){ r->range_start = first ; }
+    }else if( strncasecmp(line.c_str(), "content-type:", 13) == 0 ){
+        r->content_type = line.substr(13);
+        r->content_type.erase(0, r->content_type.find_first_not_of(" \t"));
+        r->content_type.erase(r->content_type.find_last_not_of(" \t\r\n") + 1);
+    }
+    return length ;
+}
+
+
+size_t curl_write_multirange(void *ptr, size_t size, size_t nmemb, MultiRangeResponse *r){
+    if( r->response_code == 200 ){
+        r->whole = true ;
+        return 0 ;
+    }
+    RateLimit &limit = r->session->limit ;
+    if( limit.enabled() ){ wait_for_tokens(limit, *r->session); }
+    r->body.append(static_cast<const char*>(ptr), size*nmemb);
+    if( limit.enabled() ){ spend_tokens(limit, size*nmemb); }
+    if( cancelled(*r->session) ){ return 0 ; }
+    return size*nmemb;
+}
+
+
+// Parts of a multipart/byteranges body (RFC 9110, 14.6) as (first byte, bytes)
+bool parse_byteranges(const std::string &body, const std::string &content_type, std::vector<std::pair<long long int, std::string>> &parts)
+{
+    std::size_t pos = content_type.find("boundary=");
+    if( pos == std::string::npos ){ return false ; }
+    std::string boundary = content_type.substr(pos + 9) ;
+    boundary = boundary.substr(0, boundary.find(';'));
+    if( boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"' ){ boundary = boundary.substr(1, boundary.size() - 2) ; }
+    if( boundary.empty() ){ return false ; }
+
+    const std::string delimiter = "--" + boundary ;
+    for(std::size_t at = body.find(delimiter) ; at != std::string::npos ; ){
+        at += delimiter.size() ;
+        if( body.compare(at, 2, "--") == 0 ){ break; } // Close delimiter
+        std::size_t headers_end = body.find("\r\n\r\n", at);
+        if( headers_end == std::string::npos ){ return false ; }
+
+        long long int first = -1, last = -1 ;
+        std::istringstream headers(body.substr(at, headers_end - at));
+        std::string line ;
+        while( std::getline(headers, line) ){
+            if( strncasecmp(line.c_str(), "content-range:", 14) == 0 ){
+                if( std::sscanf(line.c_str() + 14, " bytes %lld-%lld", &first, &last) != 2 ){ return false ; }
+            }
+        }
+        const std::size_t data = headers_end + 4 ;
+        if( first < 0 || last < first || data + (last - first + 1) > body.size() ){ return false ; }
+        parts.push_back(std::make_pair(first, body.substr(data, last - first + 1)));
+        at = body.find(delimiter, data + (last - first + 1));
+    }
+
+return !parts.empty(); }
+
+
+// Inclusive ranges of url in one GET (Range: bytes=a-b,c-d,...), data[k] gets the bytes of ranges[k]
+// No retry: false falls back to one download_range() per range, 'unsupported' when the server
+// ignores multi-range requests (200) or answers parts not covering them
+bool download_ranges(Session &session, const std::string &url, const std::vector<std::pair<long long int, long long int>> &ranges, std::vector<std::vector<char>> &data, bool verbose, bool &unsupported)
+{
+    unsupported = false ;
+    CURL *curl = curl_easy_init();
+    if( !curl ){
+        std::printf("CO-CURL::ERROR -- Cannot initialize cURL for downloading '%s'\n", url.c_str());
+        return false ;
+    }
+
+    std::string range ;
+    for(const auto &r : ranges){
+        range += (range.empty() ? "" : ",") + std::to_string(r.first) + "-" + std::to_string(r.second) ;
+    }
+    MultiRangeResponse response ;
+    response.session = &session ;
+    setup_transfer(curl, session, url);
+    curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_multirange);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_multirange);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, verbose);
+    CURLcode res = curl_easy_perform(curl); // *** Main cURL: download ***
+    curl_easy_cleanup(curl);
+
+    std::vector<std::pair<long long int, std::string>> parts ;
+    if( response.whole ){
+        unsupported = true ;
+    }else if( res != CURLE_OK ){
+        if( verbose ){ std::printf("CO-CURL:: Multi-range request failed --> %s\n", curl_easy_strerror(res)); }
+        return false ;
+    }else if( response.response_code == 206 ){
+        if( strncasecmp(response.content_type.c_str(), "multipart/byteranges", 20) == 0 ){
+            unsupported = !parse_byteranges(response.body, response.content_type, parts) ;
+        }else if( response.range_start >= 0 ){
+            parts.push_back(std::make_pair(response.range_start, std::move(response.body)));
+        }
+    }
+
+    // Each range out of the part covering it, parts may come merged or reordered
+    data.assign(ranges.size(), std::vector<char>());
+    for(std::size_t k=0 ; k<ranges.size() && !unsupported ; ++k){
+        auto part = std::find_if(parts.begin(), parts.end(), [&](const std::pair<long long int, std::string> &p){
+            return p.first <= ranges[k].first && ranges[k].second < p.first + static_cast<long long int>(p.second.size()) ;
+        });
+        if( part == parts.end() ){
+            unsupported = true ;
+        }else{
+            const char *bytes = part->second.data() + (ranges[k].first - part->first) ;
+            data[k].assign(bytes, bytes + (ranges[k].second - ranges[k].first + 1));
+        }
+    }
+    if( unsupported && verbose ){
+        std::printf("CO-CURL:: Server does not support multi-range requests, one request per range.\n");
+    }
+
+return !unsupported; }
+
+
+struct RemoteFile::Impl {
+    std::string url ;
+    Options options ;
+    Session session ;
+    long long int block_size ;
+    std::size_t cache_blocks ;
+    int read_ahead = DEFAULT_READ_AHEAD ;
+    long long int file_size = -2 ;         // -2 --> not asked yet
+    long long int last_end = -1 ;          // End of the previous read, a read starting there is sequential
+    std::list<long long int> lru ;         // Cached blocks, most recently used first
+    std::unordered_map<long long int, std::pair<std::vector<char>, std::list<long long int>::iterator>> blocks ;
+    bool multi_range = true ;              // Until the server ignores or mangles a multi-range GET
+    Stats stats = {0, 0, 0, 0, 0} ;
+
+    void touch(long long int block){
+        auto &entry = blocks[block] ;
+        lru.erase(entry.second);
+        lru.push_front(block);
+        entry.second = lru.begin();
+    }
+
+    void evict(){
+        while( lru.size() > cache_blocks ){
+            blocks.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+    bool fetch(const std::set<long long int> &missing) ;
+};
+
+
+// Missing blocks as runs, blocks at most range_gap apart joined (the gap over-fetched to save a
+// round-trip, unless a block of it is cached), runs spread over the connections with up to
+// MAX_RANGES_PER_REQUEST per multi-range GET
+bool RemoteFile::Impl::fetch(const std::set<long long int> &missing)
+{
+    const long long int gap_blocks = (std::max(options.range_gap, 0LL) + block_size - 1)/block_size ;
+    std::vector<std::pair<long long int, long long int>> runs ;
+    for(long long int block : missing){
+        bool join = !runs.empty() && block - runs.back().second - 1 <= gap_blocks ;
+        for(long long int gap=block-1 ; join && gap>runs.back().second ; --gap){ join = (blocks.count(gap) == 0) ; }
+        if( join ){ runs.back().second = block ; }
+        else{ runs.push_back(std::make_pair(block, block)); }
+    }
+    if( runs.empty() ){ return true ; }
+
+    // Fewer runs than connections --> one GET each, all at once
+    const int num_connection = (options.num_connection > 0) ? options.num_connection : options.num_thread ;
+    const std::size_t per_request = (multi_range) ? std::min((runs.size() + num_connection - 1)/num_connection, static_cast<std::size_t>(MAX_RANGES_PER_REQUEST)) : 1 ;
+    const std::size_t num_batch = (runs.size() + per_request - 1)/per_request ;
+
+    bool success = true ;
+    long long int num_request = 0 ;
+    std::vector<MemorySink> buffers(runs.size()) ;
+    omp_set_num_threads(std::min(num_connection, static_cast<int>(num_batch)));
+    #pragma omp parallel for schedule(dynamic) reduction(+:num_request)
+    for(std::size_t b=0 ; b<num_batch ; ++b)
+    {
+        const std::size_t first = b*per_request, last = std::min(first + per_request, runs.size()) ;
+        std::vector<std::pair<long long int, long long int>> ranges ;
+        for(std::size_t k=first ; k<last ; ++k){
+            ranges.push_back(std::make_pair(runs[k].first*block_size, std::min((runs[k].second + 1)*block_size, file_size) - 1));
+        }
+
+        bool multi ;
+        #pragma omp atomic read
+        multi = multi_range ;
+        if( multi && ranges.size() > 1 ){
+            std::vector<std::vector<char>> data ;
+            bool unsupported ;
+            ++num_request ;
+            if( download_ranges(session, url, ranges, data, options.verbose, unsupported) ){
+                for(std::size_t k=first ; k<last ; ++k){ buffers[k].data = std::move(data[k - first]); }
+                continue;
+            }
+            if( unsupported ){
+                #pragma omp atomic write
+                multi_range = false ;
+            }
+        }
+        for(std::size_t k=first ; k<last ; ++k){
+            const long long int start = ranges[k - first].first, end = ranges[k - first].second ;
+            buffers[k].data.assign(end - start + 1, 0);
+            ++num_request ;
+            if( !download_range(session, -1, 0, url, url, start, end, NULL, options.verbose, &buffers[k]) ){
+                #pragma omp atomic write
+                success = false ;
+            }
+        }
+    }
+    stats.requests += num_request ;
+    if( !success ){ return false ; }
+
+    for(std::size_t k=0 ; k<runs.size() ; ++k){
+        const std::vector<char> &data = buffers[k].data ;
+        for(long long int block=runs[k].first ; block<=runs[k].second ; ++block){
+            long long int from = (block - runs[k].first)*block_size ;
+            long long int to = std::min(from + block_size, static_cast<long long int>(data.size())) ;
+            auto cached = blocks.find(block) ;
+            if( cached != blocks.end() ){ lru.erase(cached->second.second); }
+            lru.push_front(block);
+            blocks[block] = std::make_pair(std::vector<char>(data.begin() + from, data.begin() + to), lru.begin());
+        }
+        stats.misses += runs[k].second - runs[k].first + 1 ;
+        stats.bytes += data.size() ;
+    }
+    stats.ranges += runs.size() ;
+
+return true; }
+
+
+RemoteFile::RemoteFile(const std::string &url, const Options &options, long long int block_size, std::size_t cache_blocks) : impl(new Impl)
+{
+    impl->url = url ;
+    impl->options = options ;
+    impl->block_size = std::max(block_size, 1LL) ;
+    impl->cache_blocks = std::max(cache_blocks, static_cast<std::size_t>(1)) ;
+    impl->multi_range = options.multi_range ;
+    impl->session.user.username = options.username ;
+    impl->session.user.password = options.password ;
+    impl->session.limit.rate = options.limit_rate ;
+    impl->session.limit.burst = options.limit_burst ;
+    impl->session.limit.schedule = options.limit_schedule ;
+    global_init();
+    init_session(impl->session);
+}
+
+
+RemoteFile::~RemoteFile()
+{
+    cleanup_session(impl->session);
+    global_cleanup();
+}
+
+
+long long int RemoteFile::size()
+{
+    if( impl->file_size == -2 ){ impl->file_size = get_file_size(impl->session, impl->url, impl->options.verbose) ; }
+    return impl->file_size ;
+}
+
+
+void RemoteFile::set_read_ahead(int num_block){ impl->read_ahead = std::max(num_block, 0) ; }
+
+void RemoteFile::set_cancellation(const CancellationToken *token){ impl->session.cancellation = token ; }
+
+RemoteFile::Stats RemoteFile::stats() const { return impl->stats ; }
+
+
+bool RemoteFile::read_ranges(const std::vector<ByteRange> &ranges, std::vector<std::vector<char>> &data)
+{
+    const long long int file_size = size() ;
+    if( file_size < 0 ){ return false ; }
+    const long long int block_size = impl->block_size ;
+
+    // Clip at the end of the file, then find the blocks not cached
+    std::vector<ByteRange> clipped ;
+    std::set<long long int> missing ;
+    for(const ByteRange &range : ranges){
+        if( range.offset < 0 || range.length < 0 ){ return false ; }
+        ByteRange r = {range.offset, std::max(std::min(range.length, file_size - range.offset), 0LL)} ;
+        clipped.push_back(r);
+        for(long long int block = r.offset/block_size ; r.length > 0 && block <= (r.offset + r.length - 1)/block_size ; ++block){
+            if( impl->blocks.count(block) ){ ++impl->stats.hits ; }
+            else{ missing.insert(block); }
+        }
+    }
+    if( clipped.size() == 1 && clipped[0].offset == impl->last_end && clipped[0].length > 0 ){
+        const long long int last_block = (file_size - 1)/block_size ;
+        long long int block = (clipped[0].offset + clipped[0].length - 1)/block_size + 1 ;
+        for(int i=0 ; i<impl->read_ahead && block<=last_block ; ++i, ++block){
+            if( !impl->blocks.count(block) ){ missing.insert(block); }
+        }
+    }
+    if( !impl->fetch(missing) ){ return false ; }
+
+    data.assign(clipped.size(), std::vector<char>());
+    for(std::size_t i=0 ; i<clipped.size() ; ++i){
+        const ByteRange &r = clipped[i] ;
+        data[i].reserve(r.length);
+        for(long long int pos = r.offset ; pos < r.offset + r.length ; ){
+            long long int block = pos/block_size ;
+            const std::vector<char> &bytes = impl->blocks[block].first ;
+            long long int from = pos - block*block_size ;
+            long long int count = std::min(static_cast<long long int>(bytes.size()) - from, r.offset + r.length - pos) ;
+            if( count <= 0 ){ return false ; }
+            data[i].insert(data[i].end(), bytes.begin() + from, bytes.begin() + from + count);
+            impl->touch(block);
+            pos += count ;
+        }
+        impl->last_end = r.offset + r.length ;
+    }
+    impl->evict();
+
+return true; }
+
+
+long long int RemoteFile::pread(long long int offset, char *buffer, long long int length)
+{
+    std::vector<std::vector<char>> data ;
+    if( !read_ranges(std::vector<ByteRange>(1, ByteRange{offset, length}), data) ){ return -1 ; }
+    std::memcpy(buffer, data[0].data(), data[0].size());
+
+return data[0].size(); }
+
+#if __cplusplus >= 202002L
+
+static_assert(WATCH_IN == CURL_POLL_IN && WATCH_OUT == CURL_POLL_OUT && WATCH_INOUT == CURL_POLL_INOUT && WATCH_REMOVE == CURL_POLL_REMOVE, "WATCH_* must match CURL_POLL_*");
+static_assert(EVENT_IN == CURL_CSELECT_IN && EVENT_OUT == CURL_CSELECT_OUT && EVENT_ERR == CURL_CSELECT_ERR, "EVENT_* must match CURL_CSELECT_*");
+
+struct AsyncClient::Impl {
+    // One awaited fetch_range() or download(), done when its last transfer ends
+    struct Operation {
+        FetchAwaiter *awaiter ;
+        Impl *client ;
+        bool planned ;           // Size known, ranges queued
+        bool failed ;
+        int num_transfer ;
+    };
+
+    // One ranged GET of an operation
+    struct Transfer {
+        CURL *curl ;
+        Operation *op ;
+        long long int start ;    // Inclusive range
+        long long int end ;      // -1 --> to the end of the file
+        long long int pos ;      // Remote position of the next received byte
+        bool receiving ;         // Body started
+        bool truncated ;         // Bytes beyond 'end' were discarded
+        bool limited ;           // Paused by the rate limit, waiting for tokens
+        bool granted ;           // Resumed by the rate limit, one write callback allowed in debt
+        RateLimit *limit ;       // NULL --> unlimited
+        long response_code ;
+        long long int range_start ;
+        long long int range_total ;
+        long long int content_length ;
+        std::string range ;
+        char errbuf[CURL_ERROR_SIZE] ;
+    };
+
+    Options options ;
+    Session session ;
+    CURLM *multi = NULL ;
+    std::map<int, int> sockets ;       // fd --> WATCH_*
+    std::chrono::steady_clock::time_point curl_deadline = std::chrono::steady_clock::time_point::max() ;  // Of libcurl's timer, max() --> none
+    std::chrono::steady_clock::time_point limit_deadline = std::chrono::steady_clock::time_point::max() ; // Tokens for the paused transfers
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max() ;       // Armed: the earlier of both
+    std::function<void(int, int)> watch ;
+    std::function<void(long)> timer ;
+    std::vector<Transfer*> queued ;    // Planned inside a write callback, added once libcurl returned
+    std::vector<Operation*> done ;     // Resumed once libcurl returned
+    std::vector<Transfer*> paused ;    // By the rate limit
+    std::size_t num_operation = 0 ;
+
+    static int socket_callback(CURL*, curl_socket_t fd, int what, void *userp, void*){
+        Impl &client = *static_cast<Impl*>(userp) ;
+        if( what == CURL_POLL_REMOVE ){ client.sockets.erase(fd); }
+        else{ client.sockets[fd] = what ; }
+        if( client.watch ){ client.watch(fd, what); }
+        return 0 ;
+    }
+
+    static int timer_callback(CURLM*, long timeout_ms, void *userp){
+        Impl &client = *static_cast<Impl*>(userp) ;
+        client.curl_deadline = (timeout_ms < 0) ? std::chrono::steady_clock::time_point::max() : std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms) ;
+        client.arm_timer();
+        return 0 ;
+    }
+
+    // One timer for libcurl and the rate limit, the application's re-armed when it moves
+    void arm_timer(){
+        const auto next = std::min(curl_deadline, limit_deadline) ;
+        if( next == deadline ){ return ; }
+        deadline = next ;
+        if( !timer ){ return ; }
+        if( next == std::chrono::steady_clock::time_point::max() ){ timer(-1); return ; }
+        timer(std::max<long>(std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count(), 0));
+    }
+
+    static size_t header_callback(char *buffer, size_t size, size_t nitems, Transfer *t) ;
+    static size_t write_callback(void *ptr, size_t size, size_t nmemb, Transfer *t) ;
+
+    Transfer* new_transfer(Operation *op, long long int start, long long int end) ;
+    bool plan(Transfer *first, long long int file_size, bool range_supported) ;
+    bool add(Transfer *t) ;
+    void finish(Transfer *t, CURLcode res) ;
+    void process() ;
+};
+
+
+// Status, Content-Range and Content-Length of the final response (after redirects)
+size_t AsyncClient::Impl::header_callback(char *buffer, size_t size, size_t nitems, Transfer *t)
+{
+    const size_t length = size*nitems ;
+    std::string line(buffer, length);
+    if( line.compare(0, 5, "HTTP/") == 0 ){
+        std::size_t pos = line.find(' ');
+        t->response_code = (pos != std::string::npos) ? std::atol(line.c_str() + pos + 1) : 0 ;
+        t->range_start = -1 ;
+        t->range_total = -1 ;
+        t->content_length = -1 ;
+    }else if( strncasecmp(line.c_str(), "content-range:", 14) == 0 ){
+        long long int first, last, total ;
+        if( std::sscanf(line.c_str() + 14, " bytes %lld-%lld/%lld", &first, &last, &total) == 3 ){
+            t->range_start = first ;
+            t->range_total = total ;
+        }
+    }else if( strncasecmp(line.c_str(), "content-length:", 15) == 0 ){
+        t->content_length = std::atoll(line.c_str() + 15);
+    }
+
+return length; }
+
+
+// Received bytes at t->pos, up to t->end, into the sink or the result buffer;
+// a full 200 response instead of 206 is skipped up to the requested offset
+size_t AsyncClient::Impl::write_callback(void *ptr, size_t size, size_t nmemb, Transfer *t)
+{
+    Operation &op = *t->op ;
+    FetchAwaiter &awaiter = *op.awaiter ;
+    if( op.failed ){ return 0 ; }
+    const char *data = static_cast<const char*>(ptr);
+    size_t total = size*nmemb ;
+    size_t remain = total ;
+
+    if( !t->receiving ){
+        t->receiving = true ;
+        if( t->response_code == 206 && t->range_start != t->start ){
+            awaiter.result.error = "Server did not honor range " + t->range ;
+            op.failed = true ;
+            return 0 ;
+        }
+        t->pos = (t->response_code == 206) ? t->start : 0 ;
+        long long int file_size = (t->response_code == 206) ? t->range_total : t->content_length ;
+        if( !op.planned && file_size > 0 && !op.client->plan(t, file_size, t->response_code == 206) ){
+            op.failed = true ;
+            return 0 ;
+        }
+        if( !op.planned && awaiter.sink ){
+            awaiter.result.error = "Cannot acquire remote file size" ;
+            op.failed = true ;
+            return 0 ;
+        }
+    }
+    if( t->limit && !t->granted && !t->limit->allow() ){
+        t->limited = true ;
+        op.client->paused.push_back(t);
+        return CURL_WRITEFUNC_PAUSE ;
+    }
+    const long long int before = t->pos ;
+    if( t->pos < t->start ){
+        size_t skip = std::min(static_cast<long long int>(remain), t->start - t->pos) ;
+        data += skip ;
+        remain -= skip ;
+        t->pos += skip ;
+    }
+    if( t->end >= 0 && t->pos + static_cast<long long int>(remain) > t->end + 1 ){
+        remain = (t->pos > t->end) ? 0 : t->end + 1 - t->pos ;
+        t->truncated = true ;
+    }
+    if( remain > 0 ){
+        if( awaiter.sink ){
+            if( !awaiter.sink->write(t->pos, data, remain) ){
+                awaiter.result.error = "The sink refused bytes at " + std::to_string(t->pos) ;
+                op.failed = true ;
+                return 0 ;
+            }
+        }else{
+            awaiter.result.data.insert(awaiter.result.data.end(), data, data + remain);
+        }
+        t->pos += remain ;
+    }
+    if( t->limit ){
+        t->limit->spend(t->pos - before);
+        t->granted = false ;
+    }
+
+return (t->truncated) ? 0 : total ; }
+
+
+AsyncClient::Impl::Transfer* AsyncClient::Impl::new_transfer(Operation *op, const long long int start, const long long int end)
+{
+    Transfer *t = new Transfer ;
+    t->curl = NULL ;
+    t->op = op ;
+    t->start = start ;
+    t->end = end ;
+    ++op->num_transfer ;
+
+return t; }
+
+
+// Once the size is known: bound the first transfer, open the sink and queue
+// the rest of the file in about equal ranges, one per remaining connection
+bool AsyncClient::Impl::plan(Transfer *first, const long long int file_size, const bool range_supported)
+{
+    Operation &op = *first->op ;
+    FetchAwaiter &awaiter = *op.awaiter ;
+    awaiter.result.file_size = file_size ;
+    op.planned = true ;
+    if( !awaiter.sink ){ return true ; }
+
+    if( !awaiter.sink->open(file_size) ){
+        awaiter.result.error = "The sink refused " + std::to_string(file_size) + " bytes" ;
+        return false ;
+    }
+    first->end = (range_supported) ? std::min(first->end, file_size - 1) : file_size - 1 ;
+    const long long int remain = file_size - first->end - 1 ;
+    const int num_connection = std::max((options.num_connection > 0) ? options.num_connection : options.num_thread, 2) ;
+    const long long int unit_size = std::max((remain + num_connection - 2)/(num_connection - 1), static_cast<long long int>(MIN_UNIT_SIZE));
+    for(long long int start=first->end+1 ; start<file_size ; start+=unit_size){
+        queued.push_back(new_transfer(&op, start, std::min(start + unit_size, file_size) - 1));
+    }
+
+return true; }
+
+
+bool AsyncClient::Impl::add(Transfer *t)
+{
+    t->curl = curl_easy_init();
+    if( !t->curl ){
+        t->op->awaiter->result.error = "Cannot initialize cURL" ;
+        return false ;
+    }
+    t->pos = t->start ;
+    t->receiving = false ;
+    t->truncated = false ;
+    t->limited = false ;
+    t->granted = false ;
+    t->limit = (session.limit.enabled()) ? &session.limit : NULL ;
+    t->response_code = 0 ;
+    t->range_start = -1 ;
+    t->range_total = -1 ;
+    t->content_length = -1 ;
+    t->range = std::to_string(t->start) + "-" + ((t->end >= 0) ? std::to_string(t->end) : "") ;
+    t->errbuf[0] = '\0' ;
+    setup_transfer(t->curl, session, t->op->awaiter->url);
+    curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, t);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, t);
+    curl_easy_setopt(t->curl, CURLOPT_RANGE, t->range.c_str());
+    curl_easy_setopt(t->curl, CURLOPT_ERRORBUFFER, t->errbuf);
+    curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t);
+    curl_easy_setopt(t->curl, CURLOPT_VERBOSE, options.verbose);
+
+return curl_multi_add_handle(multi, t->curl) == CURLM_OK ; }
+
+
+// A transfer ended: record its outcome, the operation is done with its last transfer
+void AsyncClient::Impl::finish(Transfer *t, CURLcode res)
+{
+    Operation &op = *t->op ;
+    FetchResult &result = op.awaiter->result ;
+    long response_code = 0 ;
+    if( t->curl ){
+        curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &response_code);
+        curl_multi_remove_handle(multi, t->curl);
+        curl_easy_cleanup(t->curl);
+    }
+    if( result.response_code == 0 ){ result.response_code = response_code ; }
+
+    bool complete = ( t->end >= 0 ) ? t->pos == t->end + 1 : res == CURLE_OK ;
+    if( op.failed ){
+        // Reason already given
+    }else if( response_code >= 400 ){
+        result.error = getHttpStatusMessage(response_code) ;
+        op.failed = true ;
+    }else if( res != CURLE_OK && !(res == CURLE_WRITE_ERROR && t->truncated) ){
+        result.error = (t->errbuf[0]) ? t->errbuf : curl_easy_strerror(res) ;
+        op.failed = true ;
+    }else if( !complete ){
+        result.error = "Received " + std::to_string(t->pos - t->start) + " of " + std::to_string(t->end - t->start + 1) + " bytes of range " + t->range ;
+        op.failed = true ;
+    }
+    if( t->limited ){ paused.erase(std::find(paused.begin(), paused.end(), t)); }
+    delete t ;
+    if( --op.num_transfer == 0 ){ done.push_back(&op); }
+}
+
+
+// After libcurl returned: collect finished transfers, start queued ones, resume the transfers
+// paused by the rate limit once it has tokens again, then resume the coroutines of completed
+// operations (which may start new fetches)
+void AsyncClient::Impl::process()
+{
+    int msgs_left = 0 ;
+    CURLMsg *msg ;
+    while( (msg = curl_multi_info_read(multi, &msgs_left)) ){
+        if( msg->msg != CURLMSG_DONE ){ continue; }
+        Transfer *t ;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&t));
+        finish(t, msg->data.result);
+    }
+    while( !queued.empty() ){
+        Transfer *t = queued.back() ;
+        queued.pop_back();
+        if( t->op->failed || !add(t) ){
+            if( t->curl ){ curl_easy_cleanup(t->curl); }
+            t->op->failed = true ;
+            if( --t->op->num_transfer == 0 ){ done.push_back(t->op); }
+            delete t ;
+        }
+    }
+    // Every paused transfer writes once, in debt if need be, as in download_multi()
+    limit_deadline = std::chrono::steady_clock::time_point::max() ;
+    if( session.limit.enabled() ){
+        session.limit.refill();
+        if( !paused.empty() && session.limit.allow() ){
+            std::vector<Transfer*> resumed ;
+            resumed.swap(paused);
+            for(Transfer *t : resumed){
+                t->limited = false ;
+                t->granted = true ;
+                curl_easy_pause(t->curl, CURLPAUSE_CONT);
+            }
+        }else if( !paused.empty() ){
+            limit_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(session.limit.wait_ms(), 1)) ;
+        }
+    }
+    arm_timer();
+    std::vector<Operation*> completed ;
+    completed.swap(done);
+    for(Operation *op : completed){
+        FetchAwaiter &awaiter = *op->awaiter ;
+        awaiter.result.ok = !op->failed ;
+        if( awaiter.sink && op->planned ){ awaiter.sink->close(!op->failed); }
+        if( !op->failed ){ awaiter.result.error.clear(); }
+        delete op ;
+        --num_operation ;
+        awaiter.handle.resume();
+    }
+}
+
+
+AsyncClient::AsyncClient(const Options &options) : impl(new Impl)
+{
+    impl->options = options ;
+    impl->session.user.username = options.username ;
+    impl->session.user.password = options.password ;
+    impl->session.limit.rate = options.limit_rate ;
+    impl->session.limit.burst = options.limit_burst ;
+    impl->session.limit.schedule = options.limit_schedule ;
+    global_init();
+    init_session(impl->session);
+    impl->multi = curl_multi_init();
+    if( !impl->multi ){
+        std::cerr << "CO-CURL::ERROR -- Cannot initialize cURL multi interface." << std::endl;
+        return;
+    }
+    const int num_connection = (options.num_connection > 0) ? options.num_connection : options.num_thread ;
+    curl_multi_setopt(impl->multi, CURLMOPT_SOCKETFUNCTION, Impl::socket_callback);
+    curl_multi_setopt(impl->multi, CURLMOPT_SOCKETDATA, impl.get());
+    curl_multi_setopt(impl->multi, CURLMOPT_TIMERFUNCTION, Impl::timer_callback);
+    curl_multi_setopt(impl->multi, CURLMOPT_TIMERDATA, impl.get());
+    curl_multi_setopt(impl->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(num_connection));
+    if( options.max_host_connection > 0 ){
+        curl_multi_setopt(impl->multi, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(options.max_host_connection));
+    }
+}
+
+
+// Fetches still pending are abandoned, their coroutines never resume
+AsyncClient::~AsyncClient()
+{
+    if( impl->multi ){ curl_multi_cleanup(impl->multi); }
+    cleanup_session(impl->session);
+    global_cleanup();
+}
+
+
+bool FetchAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    this->handle = handle ;
+return client->start(this); }
+
+
+// Suspend the awaiting coroutine unless the fetch is over at once (empty range or no cURL)
+bool AsyncClient::start(FetchAwaiter *awaiter)
+{
+    if( awaiter->length == 0 ){
+        awaiter->result.ok = true ;
+        return false ;
+    }
+    if( !impl->multi ){
+        awaiter->result.error = "Cannot initialize cURL multi interface" ;
+        return false ;
+    }
+    Impl::Operation *op = new Impl::Operation{awaiter, impl.get(), false, false, 0} ;
+    long long int end = (awaiter->length > 0) ? awaiter->offset + awaiter->length - 1 : (awaiter->sink) ? PROBE_UNIT_SIZE - 1 : -1 ;
+    Impl::Transfer *t = impl->new_transfer(op, awaiter->offset, end) ;
+    if( !impl->add(t) ){
+        if( t->curl ){ curl_easy_cleanup(t->curl); }
+        delete t ;
+        delete op ;
+        return false ;
+    }
+    ++impl->num_operation ;
+
+return true; }
+
+
+FetchAwaiter AsyncClient::fetch_range(const std::string &url, long long int offset, long long int length)
+{
+    return FetchAwaiter(this, url, offset, length, nullptr) ;
+}
+
+
+FetchAwaiter AsyncClient::download(const std::string &url, Sink &sink)
+{
+    return FetchAwaiter(this, url, 0, -1, &sink) ;
+}
+
+
+void AsyncClient::on_watch(std::function<void(int fd, int what)> callback){ impl->watch = std::move(callback); }
+
+void AsyncClient::on_timer(std::function<void(long timeout_ms)> callback){ impl->timer = std::move(callback); }
+
+std::size_t AsyncClient::num_pending() const { return impl->num_operation ; }
+
+
+void AsyncClient::socket_action(int fd, int events)
+{
+    if( fd < 0 ){
+        // The timer is one shot, libcurl sets its next one once it expired, arm_timer() re-arms the rest
+        impl->deadline = std::chrono::steady_clock::time_point::max() ;
+        if( std::chrono::steady_clock::now() >= impl->curl_deadline ){ impl->curl_deadline = std::chrono::steady_clock::time_point::max() ; }
+    }
+    int running = 0 ;
+    CURLMcode mc = curl_multi_socket_action(impl->multi, (fd < 0) ? CURL_SOCKET_TIMEOUT : fd, events, &running);
+    if( mc != CURLM_OK ){
+        std::cerr << "CO-CURL::ERROR -- cURL multi interface failed --> " << curl_multi_strerror(mc) << std::endl;
+    }
+    impl->process();
+}
+
+
+void AsyncClient::run()
+{
+    std::vector<pollfd> fds ;
+    while( impl->num_operation > 0 )
+    {
+        fds.clear();
+        for(const auto &s : impl->sockets){
+            short events = ((s.second & CURL_POLL_IN) ? POLLIN : 0) | ((s.second & CURL_POLL_OUT) ? POLLOUT : 0) ;
+            fds.push_back(pollfd{s.first, events, 0});
+        }
+        // What is left of the armed timer, not the timeout it was set with
+        long long int timeout = POLL_TIMEOUT_MS ;
+        if( impl->deadline != std::chrono::steady_clock::time_point::max() ){
+            long long int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(impl->deadline - std::chrono::steady_clock::now()).count() ;
+            timeout = std::clamp(remaining, 0LL, timeout) ;
+        }
+        int n = poll(fds.data(), fds.size(), static_cast<int>(timeout));
+        if( n < 0 && errno != EINTR ){
+            std::cerr << "CO-CURL::ERROR -- Cannot poll sockets --> " << std::strerror(errno) << std::endl;
+            return;
+        }
+        if( n <= 0 ){
+            socket_action(-1, 0);
+            continue;
+        }
+        for(const pollfd &p : fds){
+            if( !p.revents ){ continue; }
+            int events = ((p.revents & POLLIN) ? CURL_CSELECT_IN : 0) | ((p.revents & POLLOUT) ? CURL_CSELECT_OUT : 0) | ((p.revents & (POLLERR | POLLHUP)) ? CURL_CSELECT_ERR : 0) ;
+            socket_action(p.fd, events);
+        }
+        // Busy sockets must not hold back an expired timer
+        if( std::chrono::steady_clock::now() >= impl->deadline ){ socket_action(-1, 0); }
+    }
+}
+
+#endif // C++20
+
+} // namespace cocurl
@@ -0,0 +1,430 @@
+/******************************************************************
+*
+*  libco-curl (Concurrent cURL library)
+*
+*  Download files concurrently over ranged requests
+*  into part files, a preallocated output, a stream or any Sink
+*
+*  Copyright (c) 2024, Somrath Kanoksirirath.
+*  All rights reserved under BSD 3-clause license.
+*
+*  g++ -Wall -Wextra -c -fPIC ./cocurl.cpp -fopenmp && ar rcs libco-curl.a cocurl.o
+*  g++ -Wall -Wextra ./app.cpp libco-curl.a -o app -fopenmp -lcurl
+*
+******************************************************************/
+
+// Usage:
+//    cocurl::Options options ;
+//    options.num_connection = 16 ;
+//    cocurl::Downloader downloader(options);
+//
+//    cocurl::MemorySink memory ;
+//    std::vector<cocurl::Request> requests(2);
+//    requests[0].url = "https://example.com/big.iso" ;   // --> big.iso (part files then merge)
+//    requests[1].url = "https://example.com/small.json" ;
+//    requests[1].sink = &memory ;                         // --> memory.data
+//    bool completed = downloader.download(requests);
+//
+// A Downloader runs one transfer loop at a time, on the calling thread.
+// Sinks are written from that thread only, in any offset order.
+//
+// With C++20 (-std=c++20 for the library and the application), AsyncClient offers the same
+// ranged GETs as awaitables on the curl multi socket interface, driven by run() or by the
+// application's own event loop through on_watch() / on_timer() / socket_action():
+//    cocurl::Task read_footer(cocurl::AsyncClient &client){
+//        cocurl::FetchResult footer = co_await client.fetch_range(url, size - 8, 8);
+//        ...
+//    }
+//    read_footer(client);
+//    client.run();
+
+#ifndef COCURL_HPP
+#define COCURL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#if __cplusplus >= 202002L
+#include <coroutine>
+#include <exception>
+#endif
+
+namespace cocurl {
+
+constexpr int DEFAULT_NUM_THREADS = 8 ;
+constexpr int MAX_NUM_CONNECTIONS = 1024 ;
+constexpr int MIN_UNIT_SIZE = 1E6 ;
+constexpr int DEFAULT_STREAM_BUFFER_MB = 256 ;
+constexpr int AUTO_MAX_CONNECTIONS = 32 ;
+constexpr int DEFAULT_BLOCK_SIZE = 1<<20 ;
+constexpr int DEFAULT_CACHE_BLOCKS = 64 ;
+constexpr int DEFAULT_READ_AHEAD = 4 ;
+constexpr int DEFAULT_RANGE_GAP = DEFAULT_BLOCK_SIZE ;
+
+
+// Destination of the bytes of one file, written in ranges as they arrive
+class Sink {
+public:
+    virtual ~Sink() {}
+
+    // Size is known, before the first write, false gives the file up
+    virtual bool open(long long int file_size){ (void)file_size ; return true ; }
+
+    // Bytes [offset, offset + size) of the file, false gives the file up
+    virtual bool write(long long int offset, const char *data, std::size_t size) = 0 ;
+
+    // Copy received bytes back, only needed to verify a sha256 or md5 checksum
+    virtual bool read(long long int offset, char *data, std::size_t size){ (void)offset ; (void)data ; (void)size ; return false ; }
+
+    // Every byte written (complete) or the file given up
+    virtual void close(bool complete){ (void)complete ; }
+};
+
+
+// The whole file in memory
+class MemorySink : public Sink {
+public:
+    std::vector<char> data ;
+
+    bool open(long long int file_size) override ;
+    bool write(long long int offset, const char *data, std::size_t size) override ;
+    bool read(long long int offset, char *data, std::size_t size) override ;
+};
+
+
+// Positional writes at base + offset into a file descriptor opened (and closed) by the caller
+class FileSink : public Sink {
+public:
+    explicit FileSink(int fd, long long int base = 0) : fd(fd), base(base) {}
+
+    bool write(long long int offset, const char *data, std::size_t size) override ;
+    bool read(long long int offset, char *data, std::size_t size) override ;
+
+private:
+    int fd ;
+    long long int base ;
+};
+
+
+// Every received range handed to a function, false aborts the file
+class CallbackSink : public Sink {
+public:
+    typedef std::function<bool(long long int offset, const char *data, std::size_t size)> Callback ;
+
+    explicit CallbackSink(Callback callback) : callback(std::move(callback)) {}
+
+    bool write(long long int offset, const char *data, std::size_t size) override ;
+
+private:
+    Callback callback ;
+};
+
+
+// Stops a running download from any thread or a signal handler, progress stays journaled
+class CancellationToken {
+public:
+    void cancel(){ flag = true ; }
+    void reset(){ flag = false ; }
+    bool cancelled() const { return flag ; }
+
+private:
+    std::atomic<bool> flag{false} ;
+};
+
+
+// Rate cap of a time of day, minutes since local midnight, wraps past midnight when end_minute <= begin_minute
+struct RateWindow {
+    int begin_minute ;
+    int end_minute ;
+    long long int rate ;       // Bytes/s, 0 --> unlimited
+};
+
+
+// -1 --> default
+struct Options {
+    int num_thread = DEFAULT_NUM_THREADS ;    // Merge threads
+    int num_connection = -1 ;                 // Concurrent connections, -1 --> num_thread (AUTO_MAX_CONNECTIONS with auto_tune)
+    int max_host_connection = -1 ;            // Per host, -1 --> num_connection
+    int num_part = -1 ;                       // Part files per file, -1 --> num_connection
+    long long int chunk_size = -1 ;           // Bytes per part, exclusive with num_part
+    long long int unit_size = -1 ;            // Bytes per work unit
+    bool direct_write = false ;               // Preallocated output instead of part files
+    bool auto_tune = false ;                  // Tune the connection count, num_connection is the ceiling
+    bool use_profiles = true ;                // With auto_tune, start from and update the host profile cache
+    int stream_fd = -1 ;                      // Receives outputs named "-" in byte order
+    long long int max_buffer = DEFAULT_STREAM_BUFFER_MB*1000000LL ; // Reorder buffer when streaming
+    std::string checksum ;                    // "<algorithm>[:<hex>]" of requests without their own
+    long long int range_gap = DEFAULT_RANGE_GAP ; // RemoteFile: missing blocks this close fetched as one range
+    bool multi_range = true ;                 // RemoteFile: several ranges per GET (Range: bytes=a-b,c-d)
+    long long int limit_rate = 0 ;            // Bytes/s over all connections of the Downloader, RemoteFile or AsyncClient, 0 --> unlimited
+    long long int limit_burst = -1 ;          // Bytes let through at once, -1 --> a quarter second at the rate
+    std::vector<RateWindow> limit_schedule ;  // Times of day with their own rate, limit_rate outside them
+    std::string username ;
+    std::string password ;
+    bool verbose = false ;
+};
+
+
+// One file to download, 'completed', 'file_size' and the durations are filled in by Downloader::download()
+struct Request {
+    std::string url ;
+    std::vector<std::string> mirrors ;  // Same file at other URLs
+    std::string output_filename ;       // Empty --> last url segment, "-" --> Options::stream_fd
+    std::string checksum ;              // "<algorithm>[:<hex>]", crc32c, sha256 or md5
+    std::string checksum_source ;       // Where the expected checksum comes from, for messages
+    Sink *sink = nullptr ;              // Not owned, nullptr --> output_filename
+
+    bool completed = false ;
+    long long int file_size = -1 ;
+    double verify_s = 0.0 ;             // Checking the checksum (what was not hashed while receiving)
+    double merge_s = 0.0 ;              // Checking and merging the part files
+};
+
+
+// One ranged GET in flight
+struct ConnectionProgress {
+    std::size_t file ;         // Index of its request
+    std::string host ;         // Of the mirror it runs on
+    long long int start ;      // Inclusive range, 'end' shrinks when its tail is stolen
+    long long int end ;
+    long long int received ;   // Bytes of this attempt so far
+    double rate ;              // Bytes/s, smoothed over the last reports
+    bool straggler ;           // Far below the median rate of the others
+};
+
+struct Progress {
+    long long int received ;   // Bytes received in this run, all files
+    long long int total ;      // Sizes of all files known so far
+    std::size_t num_finished ; // Files completed or given up
+    std::size_t num_files ;
+    double elapsed_s ;
+    double rate ;              // Bytes/s since the previous report
+    double average_rate ;      // Bytes/s since the start
+    double eta_s ;             // -1 --> unknown (sizes not known yet, or nothing received lately)
+    int num_stragglers ;
+    std::vector<ConnectionProgress> connections ;
+};
+
+typedef std::function<void(const Progress&)> ProgressCallback ;
+
+
+// One ranged GET as it ended, successful or not, phases from CURLINFO_*_TIME_T
+struct TransferTiming {
+    std::size_t file ;         // Index of its request
+    int part ;
+    std::string host ;         // Of the mirror it ran on
+    long long int start ;      // Requested range, inclusive
+    long long int end ;
+    long long int received ;   // Bytes kept from this attempt
+    int attempt ;              // 0 --> first try of the range
+    long response_code ;
+    bool ok ;
+    std::string error ;        // Empty when ok
+    double begin_s ;           // Since the start of Downloader::download()
+    double dns_s ;             // Name lookup, 0 on a reused connection
+    double connect_s ;         // TCP connect after the lookup
+    double tls_s ;             // TLS handshake, 0 without TLS
+    double wait_s ;            // Request sent until the first byte (TTFB minus the phases above)
+    double transfer_s ;        // First to last byte
+    double total_s ;
+};
+
+typedef std::function<void(const TransferTiming&)> TransferCallback ;
+
+
+class Downloader {
+public:
+    explicit Downloader(const Options &options = Options()) ;
+    ~Downloader() ;
+    Downloader(const Downloader&) = delete ;
+    Downloader& operator=(const Downloader&) = delete ;
+
+    // Called on the downloading thread a few times a second and once at the end, by download() only
+    void on_progress(ProgressCallback callback) ;
+    // Called on the downloading thread as every ranged GET of download() ends
+    void on_transfer(TransferCallback callback) ;
+    void set_cancellation(const CancellationToken *token) ;
+
+    // Download every request through one event loop sharing the connection budget,
+    // then merge part files, true when all completed
+    bool download(std::vector<Request> &requests) ;
+
+    // Remote file size from a HEAD request, -1 on failure
+    long long int file_size(const std::string &url) ;
+
+    // Part 'part_index' of the Options layout into output_filename.part<index>, resumable,
+    // the whole file into output_filename when it is too small to split
+    bool download_part(const std::string &url, const std::string &output_filename, int part_index) ;
+
+    // Check, merge and remove the part files downloaded by download_part()
+    bool merge_parts(const std::string &url, const std::string &output_filename) ;
+
+private:
+    struct Impl ;
+    std::unique_ptr<Impl> impl ;
+};
+
+
+struct ByteRange {
+    long long int offset ;
+    long long int length ;
+};
+
+
+// Random access to a remote file through ranged GETs (with the retries of download_part()),
+// cached as an LRU of block_size blocks. Missing blocks of a read are fetched as runs of
+// adjacent blocks, one request per run and up to Options::num_connection runs at once;
+// a read continuing the previous one also fetches the next read_ahead blocks.
+// Needs a server honoring ranged requests. Not thread-safe.
+class RemoteFile {
+public:
+    explicit RemoteFile(const std::string &url, const Options &options = Options(), long long int block_size = DEFAULT_BLOCK_SIZE, std::size_t cache_blocks = DEFAULT_CACHE_BLOCKS) ;
+    ~RemoteFile() ;
+    RemoteFile(const RemoteFile&) = delete ;
+    RemoteFile& operator=(const RemoteFile&) = delete ;
+
+    // Remote file size (HEAD request on first use), -1 if unknown
+    long long int size() ;
+
+    // Up to 'length' bytes at 'offset' into buffer, fewer at the end of the file, -1 on failure
+    long long int pread(long long int offset, char *buffer, long long int length) ;
+
+    // Several ranges at once, the blocks missing for all of them fetched together: runs at most
+    // Options::range_gap apart joined, runs spread over the connections in multi-range GETs,
+    // data[i] gets the bytes of ranges[i] (clipped at the end of the file)
+    bool read_ranges(const std::vector<ByteRange> &ranges, std::vector<std::vector<char>> &data) ;
+
+    void set_read_ahead(int num_block) ;
+    void set_cancellation(const CancellationToken *token) ;
+
+    struct Stats {
+        long long int hits ;       // Blocks found in the cache
+        long long int misses ;     // Blocks fetched (read-ahead and gaps included)
+        long long int ranges ;     // Runs of blocks fetched
+        long long int requests ;   // Ranged GETs, one per run or several runs per multi-range GET
+        long long int bytes ;      // Bytes received
+    };
+    Stats stats() const ;
+
+private:
+    struct Impl ;
+    std::unique_ptr<Impl> impl ;
+};
+
+
+// "a-b,c-,-n": inclusive ranges as in an HTTP Range header, "c-" to the end, "-n" the last n bytes (n > 0),
+// false for an empty file or an unknown size (file_size <= 0)
+bool parse_byte_ranges(const std::string &spec, long long int file_size, std::vector<ByteRange> &ranges) ;
+
+
+#if __cplusplus >= 202002L
+
+struct FetchResult {
+    bool ok = false ;
+    long response_code = 0 ;
+    long long int file_size = -1 ;  // From Content-Range or Content-Length, -1 if unknown
+    std::vector<char> data ;        // fetch_range() only, download() writes into its sink
+    std::string error ;
+};
+
+
+class AsyncClient ;
+
+// Awaitable of AsyncClient::fetch_range() or download(): the transfers start when awaited
+// and the coroutine is resumed from run() or socket_action(), on the thread driving the client
+class FetchAwaiter {
+public:
+    bool await_ready() const noexcept { return false ; }
+    bool await_suspend(std::coroutine_handle<> handle) ;
+    FetchResult await_resume(){ return std::move(result) ; }
+
+private:
+    friend class AsyncClient ;
+    FetchAwaiter(AsyncClient *client, const std::string &url, long long int offset, long long int length, Sink *sink)
+    : client(client), url(url), offset(offset), length(length), sink(sink) {}
+
+    AsyncClient *client ;
+    std::string url ;
+    long long int offset ;
+    long long int length ;  // -1 --> to the end of the file
+    Sink *sink ;            // nullptr --> result.data
+    std::coroutine_handle<> handle ;
+    FetchResult result ;
+};
+
+
+// Eager coroutine without a result, its frame is freed when it returns
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return Task() ; }
+        std::suspend_never initial_suspend() noexcept { return {} ; }
+        std::suspend_never final_suspend() noexcept { return {} ; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+
+// Interest in a socket, as CURL_POLL_*
+enum { WATCH_IN = 1, WATCH_OUT = 2, WATCH_INOUT = 3, WATCH_REMOVE = 4 } ;
+// Readiness of a socket, as CURL_CSELECT_*
+enum { EVENT_IN = 1, EVENT_OUT = 2, EVENT_ERR = 4 } ;
+
+
+// Ranged GETs as awaitables, any number in flight over at most Options::num_connection
+// connections (Options::max_host_connection per host), all driven by one thread
+class AsyncClient {
+public:
+    explicit AsyncClient(const Options &options = Options()) ;
+    ~AsyncClient() ;
+    AsyncClient(const AsyncClient&) = delete ;
+    AsyncClient& operator=(const AsyncClient&) = delete ;
+
+    // Bytes [offset, offset + length) of url, length -1 --> to the end of the file
+    FetchAwaiter fetch_range(const std::string &url, long long int offset, long long int length) ;
+
+    // The whole file into sink, in ranges over up to Options::num_connection connections
+    FetchAwaiter download(const std::string &url, Sink &sink) ;
+
+    // Drive the transfers with poll() until none is left
+    void run() ;
+
+    // Or from the application's event loop: watch fd for 'what' (WATCH_*), arm a timer
+    // (-1 --> none), then call socket_action(fd, EVENT_*) when ready, socket_action(-1, 0) on timeout
+    void on_watch(std::function<void(int fd, int what)> callback) ;
+    void on_timer(std::function<void(long timeout_ms)> callback) ;
+    void socket_action(int fd, int events) ;
+
+    // Awaited fetches not yet completed
+    std::size_t num_pending() const ;
+
+private:
+    friend class FetchAwaiter ;
+    struct Impl ;
+    std::unique_ptr<Impl> impl ;
+
+    bool start(FetchAwaiter *awaiter) ;
+};
+
+#endif // C++20
+
+
+// True for "<algorithm>[:<hex>]" with algorithm crc32c, sha256 or md5
+bool valid_checksum(const std::string &spec) ;
+
+// Known-answer tests of the built-in crc32c, sha256 and md5, false with the failures on stderr
+bool self_test() ;
+
+// "500M" or "200M@08:00-18:00,1G": bytes/s with a K, M or G (x1000) suffix, optionally for a time of day,
+// the first window containing the local time applies, a rate without a window applies outside them
+bool parse_rate_limit(const std::string &spec, long long int &rate, std::vector<RateWindow> &schedule) ;
+
+// One "<url> [output [algo:hex]]" per line, or every <file> of a Metalink file
+bool read_manifest(const std::string &input_filename, std::vector<Request> &requests) ;
+
+} // namespace cocurl
+
+#endif // COCURL_HPP